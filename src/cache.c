@@ -0,0 +1,713 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cache.h"
+#include "http.h"
+#include "logging.h"
+#include "options.h"
+
+/* IPP delimiter tags, and the operations which cannot change anything */
+#define IPP_TAG_OPERATION 0x01
+#define IPP_TAG_END 0x03
+#define IPP_TAG_VALUE_MIN 0x10
+#define IPP_OP_VALIDATE_JOB 0x0004
+#define IPP_OP_GET_JOB_ATTRIBUTES 0x0009
+#define IPP_OP_GET_JOBS 0x000A
+#define IPP_OP_GET_PRINTER_ATTRIBUTES 0x000B
+#define IPP_OP_GET_PRINTER_SUPPORTED_VALUES 0x0015
+
+/* Room for the status line and headers we put in front of a cached body */
+#define CACHE_HEADER_MAX 128
+
+struct cache_entry {
+  int used;
+  struct cache_query query;
+  /* The IPP response, without HTTP framing */
+  uint8_t *body;
+  size_t body_len;
+  /* When it was stored, and when a request was sent to the printer to
+     refresh it, 0 if none is underway */
+  time_t stored;
+  time_t refreshing;
+  uint32_t hits;
+};
+
+/* Guards everything below */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry cache_entries[CACHE_MAX_ENTRIES];
+/* Counts the invalidations, see struct cache_fill */
+static uint32_t cache_generation = 0;
+
+static struct {
+  uint32_t hits;
+  uint32_t subset_hits;
+  uint32_t stale_hits;
+  uint32_t misses;
+  uint32_t refreshes;
+  uint32_t stores;
+  uint32_t invalidations;
+  /* Bytes of requests and responses which did not cross the USB */
+  uint64_t bytes_saved;
+} cache_stats;
+
+/* An attribute, or a delimiter tag with no name or value */
+struct ipp_attr {
+  uint8_t tag;
+  const uint8_t *name;
+  size_t name_len;
+  const uint8_t *value;
+  size_t value_len;
+  /* Bytes it takes up in the message */
+  size_t size;
+};
+
+static time_t cache_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Reads the attribute or delimiter tag at |pos| of the |len| bytes of IPP at
+   |buf|. Returns -1 if it does not fit. */
+static int ipp_next(const uint8_t *buf, size_t len, size_t pos,
+		    struct ipp_attr *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  if (pos >= len)
+    return -1;
+  attr->tag = buf[pos];
+  attr->size = 1;
+  if (attr->tag < IPP_TAG_VALUE_MIN)
+    return 0;
+
+  /* value-tag, name-length, name, value-length, value */
+  if (len - pos < 5)
+    return -1;
+  attr->name_len = ((size_t)buf[pos + 1] << 8) | buf[pos + 2];
+  if (len - pos - 5 < attr->name_len)
+    return -1;
+  attr->name = buf + pos + 3;
+  size_t at = pos + 3 + attr->name_len;
+  attr->value_len = ((size_t)buf[at] << 8) | buf[at + 1];
+  if (len - at - 2 < attr->value_len)
+    return -1;
+  attr->value = buf + at + 2;
+  attr->size = 5 + attr->name_len + attr->value_len;
+  return 0;
+}
+
+static int ipp_name_is(const struct ipp_attr *attr, const char *name)
+{
+  return attr->name_len == strlen(name) &&
+    memcmp(attr->name, name, attr->name_len) == 0;
+}
+
+/* Copies the value of |attr| into |dst| of CACHE_FIELD_MAX bytes. Returns -1
+   if it does not fit. */
+static int ipp_copy_value(const struct ipp_attr *attr, char *dst)
+{
+  if (attr->value_len >= CACHE_FIELD_MAX)
+    return -1;
+  memcpy(dst, attr->value, attr->value_len);
+  dst[attr->value_len] = '\0';
+  return 0;
+}
+
+/* Follows the whole message at the start of the |len| bytes at |buf| through
+   |framer|, telling where its body begins, where it ends and whether it is
+   chunked, which the framer forgets at its end. Returns -1 if it is not
+   complete within them. */
+static int cache_frame(struct http_framer *framer, const uint8_t *buf,
+		       size_t len, size_t *body, size_t *end, int *chunked)
+{
+  enum http_framer_event event;
+  size_t used = 0;
+
+  *body = 0;
+  *chunked = 0;
+  do {
+    used += http_framer_next(framer, buf + used, len - used, &event);
+    if (event == HTTP_FRAMER_EVENT_HEADERS_END) {
+      *body = used;
+      *chunked = framer->chunked;
+    }
+    if (event == HTTP_FRAMER_EVENT_MESSAGE_END) {
+      *end = used;
+      return 0;
+    }
+  } while (event != HTTP_FRAMER_EVENT_NONE);
+
+  return -1;
+}
+
+/* Copies the chunked body in the |len| bytes at |in| to |out| of |cap| bytes
+   without its chunk framing. Returns the length of the body, or -1 if it is
+   malformed or does not fit. */
+static long cache_dechunk(const uint8_t *in, size_t len, uint8_t *out,
+			  size_t cap)
+{
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    const uint8_t *eol = memchr(in + i, '\n', len - i);
+    if (eol == NULL)
+      return -1;
+    char *end;
+    unsigned long size = strtoul((const char *)in + i, &end, 16);
+    if (end == (const char *)in + i)
+      return -1;
+    i = (size_t)(eol - in) + 1;
+    if (size == 0)
+      break;
+    if (size > len - i || size > cap - n)
+      return -1;
+    memcpy(out + n, in + i, size);
+    n += size;
+    i += size;
+    /* The CRLF which terminates the chunk data */
+    if (i < len && in[i] == '\r')
+      i++;
+    if (i < len && in[i] == '\n')
+      i++;
+  }
+
+  return (long)n;
+}
+
+/* Copies the body of a message, which runs from |body| to |end| of |buf|, to
+   |out| of |cap| bytes. Returns its length or -1. */
+static long cache_body(int chunked, const uint8_t *buf, size_t body,
+		       size_t end, uint8_t *out, size_t cap)
+{
+  if (chunked)
+    return cache_dechunk(buf + body, end - body, out, cap);
+  if (end - body > cap)
+    return -1;
+  memcpy(out, buf + body, end - body);
+  return (long)(end - body);
+}
+
+static int query_has_name(const struct cache_query *query,
+			  const uint8_t *name, size_t len)
+{
+  const char *p = query->names;
+  for (uint32_t i = 0; i < query->num_names; i++) {
+    size_t name_len = strlen(p);
+    if (name_len == len && memcmp(p, name, len) == 0)
+      return 1;
+    p += name_len + 1;
+  }
+  return 0;
+}
+
+/* Whether every attribute |query| asks for is among those of |other| */
+static int query_names_within(const struct cache_query *query,
+			      const struct cache_query *other)
+{
+  const char *p = query->names;
+  for (uint32_t i = 0; i < query->num_names; i++) {
+    size_t len = strlen(p);
+    if (!query_has_name(other, (const uint8_t *)p, len))
+      return 0;
+    p += len + 1;
+  }
+  return 1;
+}
+
+static int query_same_context(const struct cache_query *a,
+			      const struct cache_query *b)
+{
+  return strcmp(a->document_format, b->document_format) == 0 &&
+    strcmp(a->natural_language, b->natural_language) == 0;
+}
+
+static int query_equal(const struct cache_query *a,
+		       const struct cache_query *b)
+{
+  if (!query_same_context(a, b) || a->all != b->all)
+    return 0;
+  return a->all || (a->num_names == b->num_names &&
+		    query_names_within(a, b) && query_names_within(b, a));
+}
+
+/* Whether the attribute |name| of |len| bytes is in one of the attribute
+   groups of the IPP response of |body_len| bytes at |body| */
+static int body_has_name(const uint8_t *body, size_t body_len,
+			 const char *name, size_t len)
+{
+  int group = 0;
+  struct ipp_attr attr;
+
+  for (size_t pos = 8; ipp_next(body, body_len, pos, &attr) == 0;
+       pos += attr.size) {
+    if (attr.tag == IPP_TAG_END)
+      break;
+    if (attr.tag < IPP_TAG_VALUE_MIN)
+      group = attr.tag;
+    else if (group != IPP_TAG_OPERATION && attr.name_len == len &&
+	     memcmp(attr.name, name, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Whether the response of |entry| holds everything |query| asks for, and
+   nothing of it which cannot be told apart. Each attribute has to be in the
+   response itself, as printers leave out some, like media-col-database,
+   unless they are asked for by name. */
+static int query_covers(const struct cache_entry *entry,
+			const struct cache_query *query)
+{
+  if (!query_same_context(&entry->query, query) || query->all ||
+      query->groups)
+    return 0;
+
+  const char *p = query->names;
+  for (uint32_t i = 0; i < query->num_names; i++) {
+    size_t len = strlen(p);
+    if (!body_has_name(entry->body, entry->body_len, p, len))
+      return 0;
+    p += len + 1;
+  }
+  return 1;
+}
+
+int cache_parse_request(const uint8_t *buf, size_t len,
+			struct cache_query *query)
+{
+  struct http_framer framer;
+  size_t body, end;
+  int chunked;
+
+  memset(query, 0, sizeof(*query));
+  http_framer_init(&framer, 0, NULL);
+  if (cache_frame(&framer, buf, len, &body, &end, &chunked))
+    return http_framer_lost(&framer) ? 0 : -1;
+  if (strcmp(framer.method, "POST") != 0 || !framer.is_ipp)
+    return 0;
+  query->length = end;
+  query->keep_alive = framer.keep_alive;
+
+  uint8_t ipp[CACHE_REQUEST_MAX];
+  long ipp_len = cache_body(chunked, buf, body, end, ipp, sizeof(ipp));
+  if (ipp_len < 9)
+    return 0;
+  if (((ipp[2] << 8) | ipp[3]) != IPP_OP_GET_PRINTER_ATTRIBUTES)
+    return 0;
+  query->request_id = ((uint32_t)ipp[4] << 24) | ((uint32_t)ipp[5] << 16) |
+    ((uint32_t)ipp[6] << 8) | ipp[7];
+
+  /* Only operation attributes are expected. Of them, the ones which may
+     change the response make up the key. */
+  int group = 0;
+  int requested = 0;
+  struct ipp_attr attr;
+  for (size_t pos = 8;; pos += attr.size) {
+    if (ipp_next(ipp, (size_t)ipp_len, pos, &attr))
+      return 0;
+    if (attr.tag == IPP_TAG_END)
+      break;
+    if (attr.tag < IPP_TAG_VALUE_MIN) {
+      group = attr.tag;
+      continue;
+    }
+    if (group != IPP_TAG_OPERATION)
+      return 0;
+    /* Additional values have no name of their own */
+    if (attr.name_len > 0)
+      requested = ipp_name_is(&attr, "requested-attributes");
+
+    if (requested) {
+      if (query->names_len + attr.value_len + 1 > sizeof(query->names))
+	return 0;
+      char *name = query->names + query->names_len;
+      memcpy(name, attr.value, attr.value_len);
+      name[attr.value_len] = '\0';
+      query->names_len += attr.value_len + 1;
+      query->num_names++;
+      if (strcmp(name, "all") == 0)
+	query->all = 1;
+      else if (strcmp(name, "printer-description") == 0 ||
+	       strcmp(name, "job-template") == 0)
+	query->groups = 1;
+    } else if (ipp_name_is(&attr, "document-format")) {
+      if (ipp_copy_value(&attr, query->document_format))
+	return 0;
+    } else if (ipp_name_is(&attr, "attributes-natural-language")) {
+      if (ipp_copy_value(&attr, query->natural_language))
+	return 0;
+    }
+  }
+  if (query->num_names == 0)
+    query->all = 1;
+
+  return 1;
+}
+
+/* Whether the |len| bytes at |body| are a successful IPP response which can
+   be read to its end. */
+static int cache_body_valid(const uint8_t *body, size_t len)
+{
+  /* version-number, status-code, request-id, then at least the end tag */
+  if (len < 9 || ((body[2] << 8) | body[3]) >= 0x0100)
+    return 0;
+  struct ipp_attr attr;
+  for (size_t pos = 8;; pos += attr.size) {
+    if (ipp_next(body, len, pos, &attr))
+      return 0;
+    if (attr.tag == IPP_TAG_END)
+      return 1;
+  }
+}
+
+/* Copies the attributes of |body| which |query| asks for to |out|, which has
+   room for all of |body|. Returns the length of the copy. */
+static size_t cache_filter(const uint8_t *body, size_t len,
+			   const struct cache_query *query, uint8_t *out)
+{
+  size_t n = 8;
+  int group = 0;
+  int keep = 1;
+  struct ipp_attr attr;
+
+  memcpy(out, body, 8);
+  for (size_t pos = 8; ipp_next(body, len, pos, &attr) == 0;
+       pos += attr.size) {
+    if (attr.tag < IPP_TAG_VALUE_MIN) {
+      group = attr.tag;
+      keep = 1;
+    } else if (attr.name_len > 0) {
+      keep = group == IPP_TAG_OPERATION ||
+	query_has_name(query, attr.name, attr.name_len);
+    }
+    if (keep) {
+      memcpy(out + n, body + pos, attr.size);
+      n += attr.size;
+    }
+    if (attr.tag == IPP_TAG_END)
+      break;
+  }
+
+  return n;
+}
+
+/* Builds the HTTP response to |query| from |entry|, with only the attributes
+   asked for if |subset| is set. Must be called with |cache_mutex| held. */
+static struct http_packet_t *cache_build_response(
+    const struct cache_entry *entry, const struct cache_query *query,
+    int subset)
+{
+  struct http_packet_t *pkt = calloc(1, sizeof(*pkt));
+  if (pkt == NULL) {
+    ERR("Cache: failed to alloc packet");
+    return NULL;
+  }
+  pkt->buffer_capacity = CACHE_HEADER_MAX + entry->body_len;
+  pkt->buffer = malloc(pkt->buffer_capacity);
+  if (pkt->buffer == NULL) {
+    ERR("Cache: failed to alloc space for the response");
+    free(pkt);
+    return NULL;
+  }
+
+  uint8_t *body = pkt->buffer + CACHE_HEADER_MAX;
+  size_t body_len = entry->body_len;
+  if (subset)
+    body_len = cache_filter(entry->body, entry->body_len, query, body);
+  else
+    memcpy(body, entry->body, body_len);
+  body[4] = (uint8_t)(query->request_id >> 24);
+  body[5] = (uint8_t)(query->request_id >> 16);
+  body[6] = (uint8_t)(query->request_id >> 8);
+  body[7] = (uint8_t)query->request_id;
+
+  int header_len = snprintf((char *)pkt->buffer, CACHE_HEADER_MAX,
+			    "HTTP/1.1 200 OK\r\n"
+			    "Content-Type: application/ipp\r\n"
+			    "Content-Length: %zu\r\n"
+			    "%s\r\n", body_len,
+			    query->keep_alive ? "" : "Connection: close\r\n");
+  memmove(pkt->buffer + header_len, body, body_len);
+  pkt->filled_size = (size_t)header_len + body_len;
+  return pkt;
+}
+
+/* Must be called with |cache_mutex| held. */
+static void cache_drop(struct cache_entry *entry)
+{
+  free(entry->body);
+  memset(entry, 0, sizeof(*entry));
+}
+
+struct http_packet_t *cache_lookup(const struct cache_query *query)
+{
+  time_t now = cache_now();
+  time_t ttl = (time_t)g_options.attr_cache_ttl;
+  struct cache_entry *entry = NULL;
+  struct http_packet_t *pkt = NULL;
+  int subset = 0;
+
+  pthread_mutex_lock(&cache_mutex);
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    struct cache_entry *e = &cache_entries[i];
+    if (!e->used)
+      continue;
+    /* Past its time even though a refresh was tried */
+    if (now - e->stored >= 2 * ttl) {
+      cache_drop(e);
+      continue;
+    }
+    if (query_equal(&e->query, query))
+      entry = e;
+  }
+  /* Otherwise a response to a larger request may hold the answer as well,
+     the freshest one is taken. */
+  if (entry == NULL) {
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+      struct cache_entry *e = &cache_entries[i];
+      if (e->used && (!subset || e->stored > entry->stored) &&
+	  query_covers(e, query)) {
+	entry = e;
+	subset = 1;
+      }
+    }
+  }
+  if (entry == NULL)
+    goto miss;
+
+  int stale = now - entry->stored >= ttl;
+  if (stale) {
+    /* The first request after the entry is due goes to the printer and its
+       response replaces the entry, the ones meanwhile get the old one. A
+       larger response is only used while it is being refreshed. */
+    if (entry->refreshing == 0 || now - entry->refreshing >= ttl) {
+      if (subset)
+	goto miss;
+      entry->refreshing = now;
+      cache_stats.refreshes++;
+      goto miss;
+    }
+    cache_stats.stale_hits++;
+  }
+
+  pkt = cache_build_response(entry, query, subset);
+  if (pkt == NULL)
+    goto miss;
+  entry->hits++;
+  cache_stats.hits++;
+  if (subset)
+    cache_stats.subset_hits++;
+  cache_stats.bytes_saved += query->length + pkt->filled_size;
+  NOTE("Cache: Answered Get-Printer-Attributes%s%s, %u of %u requests "
+       "so far", subset ? " from a larger response" : "",
+       stale ? " while it is refreshed" : "", cache_stats.hits,
+       cache_stats.hits + cache_stats.misses);
+  pthread_mutex_unlock(&cache_mutex);
+  return pkt;
+
+ miss:
+  cache_stats.misses++;
+  pthread_mutex_unlock(&cache_mutex);
+  return NULL;
+}
+
+/* Keeps |body| as the response to |query|, unless the cache was invalidated
+   since the request was sent, which was |generation|. */
+static void cache_store(const struct cache_query *query, uint32_t generation,
+			uint8_t *body, size_t len)
+{
+  pthread_mutex_lock(&cache_mutex);
+  if (generation != cache_generation) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(body);
+    return;
+  }
+
+  /* Replace the entry for the same request, or take a free one, or the
+     oldest one. */
+  struct cache_entry *entry = NULL;
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    struct cache_entry *e = &cache_entries[i];
+    if (e->used && query_equal(&e->query, query)) {
+      entry = e;
+      break;
+    }
+    if (entry == NULL || (entry->used && (!e->used ||
+					  e->stored < entry->stored)))
+      entry = e;
+  }
+  cache_drop(entry);
+  entry->used = 1;
+  entry->query = *query;
+  entry->body = body;
+  entry->body_len = len;
+  entry->stored = cache_now();
+  cache_stats.stores++;
+  pthread_mutex_unlock(&cache_mutex);
+
+  NOTE("Cache: Stored a Get-Printer-Attributes response of %zu bytes", len);
+}
+
+void cache_fill_begin(struct cache_fill *fill, const struct cache_query *query)
+{
+  cache_fill_abort(fill);
+  fill->pkt = packet_new();
+  if (fill->pkt == NULL)
+    return;
+  fill->active = 1;
+  fill->query = *query;
+  http_framer_init(&fill->framer, 1, NULL);
+
+  pthread_mutex_lock(&cache_mutex);
+  fill->generation = cache_generation;
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Stores the response collected in |fill| if it can be used. */
+static void cache_fill_done(struct cache_fill *fill)
+{
+  struct http_packet_t *pkt = fill->pkt;
+  struct http_framer framer;
+  size_t body, end;
+  int chunked;
+
+  http_framer_init(&framer, 1, NULL);
+  if (cache_frame(&framer, pkt->buffer, pkt->filled_size, &body, &end,
+		  &chunked) ||
+      framer.status != 200 || !framer.is_ipp)
+    return;
+
+  uint8_t *ipp = malloc(end - body);
+  if (ipp == NULL)
+    return;
+  long len = cache_body(chunked, pkt->buffer, body, end, ipp, end - body);
+  if (len < 0 || !cache_body_valid(ipp, (size_t)len)) {
+    free(ipp);
+    return;
+  }
+  cache_store(&fill->query, fill->generation, ipp, (size_t)len);
+}
+
+void cache_fill_feed(struct cache_fill *fill, const uint8_t *buf, size_t len)
+{
+  enum http_framer_event event;
+  size_t used = 0;
+
+  if (!fill->active)
+    return;
+
+  do {
+    size_t n = http_framer_next(&fill->framer, buf + used, len - used,
+				&event);
+    struct http_packet_t *pkt = fill->pkt;
+    if (pkt->filled_size + n > pkt->buffer_capacity) {
+      size_t capacity = pkt->buffer_capacity;
+      while (capacity < pkt->filled_size + n)
+	capacity *= 2;
+      uint8_t *buffer = capacity <= CACHE_RESPONSE_MAX ?
+	realloc(pkt->buffer, capacity) : NULL;
+      if (buffer == NULL) {
+	/* Too large to be kept */
+	cache_fill_abort(fill);
+	return;
+      }
+      pkt->buffer = buffer;
+      pkt->buffer_capacity = capacity;
+    }
+    memcpy(pkt->buffer + pkt->filled_size, buf + used, n);
+    pkt->filled_size += n;
+    used += n;
+
+    if (event == HTTP_FRAMER_EVENT_MESSAGE_END) {
+      cache_fill_done(fill);
+      cache_fill_abort(fill);
+      return;
+    }
+  } while (event != HTTP_FRAMER_EVENT_NONE);
+
+  if (http_framer_lost(&fill->framer))
+    cache_fill_abort(fill);
+}
+
+void cache_fill_abort(struct cache_fill *fill)
+{
+  if (fill->pkt != NULL)
+    packet_free(fill->pkt);
+  fill->pkt = NULL;
+  fill->active = 0;
+}
+
+void cache_note_operation(int operation)
+{
+  switch (operation) {
+  case IPP_OP_VALIDATE_JOB:
+  case IPP_OP_GET_JOB_ATTRIBUTES:
+  case IPP_OP_GET_JOBS:
+  case IPP_OP_GET_PRINTER_ATTRIBUTES:
+  case IPP_OP_GET_PRINTER_SUPPORTED_VALUES:
+    return;
+  default:
+    break;
+  }
+
+  uint32_t dropped = 0;
+  pthread_mutex_lock(&cache_mutex);
+  /* Responses on their way are outdated as well */
+  cache_generation++;
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    if (cache_entries[i].used) {
+      cache_drop(&cache_entries[i]);
+      dropped++;
+    }
+  }
+  if (dropped)
+    cache_stats.invalidations++;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (dropped)
+    NOTE("Cache: Dropped %u responses for IPP operation 0x%04x", dropped,
+	 operation);
+}
+
+void cache_log_stats(void)
+{
+  pthread_mutex_lock(&cache_mutex);
+  uint32_t lookups = cache_stats.hits + cache_stats.misses;
+  NOTE("Cache: Answered %u of %u Get-Printer-Attributes requests (%.1f%%), "
+       "%u of them from a larger response and %u while it was refreshed",
+       cache_stats.hits, lookups,
+       lookups > 0 ? 100.0 * cache_stats.hits / lookups : 0.0,
+       cache_stats.subset_hits, cache_stats.stale_hits);
+  NOTE("Cache: %u responses stored, %u refreshes, %u invalidations, "
+       "%llu bytes of USB traffic saved", cache_stats.stores,
+       cache_stats.refreshes, cache_stats.invalidations,
+       (unsigned long long)cache_stats.bytes_saved);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+void cache_shutdown(void)
+{
+  pthread_mutex_lock(&cache_mutex);
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++)
+    cache_drop(&cache_entries[i]);
+  pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,98 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+
+/* Cache of the responses of the printer to Get-Printer-Attributes, which
+   every CUPS backend, cups-browsed, ippfind and printer applet keeps polling.
+   Entries are kept for g_options.attr_cache_ttl seconds and for as long again
+   while one request refreshes them, and dropped whenever an operation which
+   may change the printer or its jobs passes through. */
+
+/* Number of different requests whose responses are kept */
+#define CACHE_MAX_ENTRIES 8
+/* Largest request looked at, and largest response kept */
+#define CACHE_REQUEST_MAX 4096
+#define CACHE_RESPONSE_MAX (512 * 1024)
+/* Room for the document-format and natural language of a request, and for
+   the names of the attributes it asks for */
+#define CACHE_FIELD_MAX 64
+#define CACHE_NAMES_MAX 2048
+
+/* What a Get-Printer-Attributes request asks for */
+struct cache_query {
+  /* Bytes of the whole HTTP request */
+  size_t length;
+  uint32_t request_id;
+  int keep_alive;
+  /* No requested-attributes or "all" among them */
+  int all;
+  /* Group names like "printer-description" among them, whose members
+     cannot be told */
+  int groups;
+  char document_format[CACHE_FIELD_MAX];
+  char natural_language[CACHE_FIELD_MAX];
+  /* The requested-attributes, each terminated by '\0' */
+  char names[CACHE_NAMES_MAX];
+  size_t names_len;
+  uint32_t num_names;
+};
+
+/* Collects the response to a request the cache could not answer, as it
+   streams from the printer to the client. */
+struct cache_fill {
+  int active;
+  struct cache_query query;
+  /* Invalidations before the request was sent, the response is not kept if
+     there was another one since. */
+  uint32_t generation;
+  struct http_framer framer;
+  struct http_packet_t *pkt;
+};
+
+/* Reads the request at the start of the |len| bytes at |buf|. Returns 1 if
+   it is a whole Get-Printer-Attributes request, described in |query|, 0 if
+   it is another one or cannot be cached and -1 if more of it has to arrive
+   to tell. */
+int cache_parse_request(const uint8_t *buf, size_t len,
+			struct cache_query *query);
+
+/* Builds the response to |query| from the cache, in a new packet holding
+   the whole HTTP response. Returns NULL if the request has to go to the
+   printer, which is also the case for the one request refreshing an entry
+   which is due. */
+struct http_packet_t *cache_lookup(const struct cache_query *query);
+
+/* Starts collecting the response to |query| in |fill|, to be fed with what
+   the printer sends from the first byte of the response on. */
+void cache_fill_begin(struct cache_fill *fill, const struct cache_query *query);
+/* Feeds response data into |fill|, which stores the response once it is
+   complete. Data after the end of the response is ignored. */
+void cache_fill_feed(struct cache_fill *fill, const uint8_t *buf, size_t len);
+/* Stops collecting, without storing anything. */
+void cache_fill_abort(struct cache_fill *fill);
+
+/* Tells the cache about the IPP |operation| of a request on its way to the
+   printer. Drops every entry if it may change the printer or its jobs. */
+void cache_note_operation(int operation);
+
+/* Logs the hit rate and the USB traffic the cache saved. */
+void cache_log_stats(void);
+
+/* Frees all entries. */
+void cache_shutdown(void);
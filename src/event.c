@@ -0,0 +1,1084 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+
+#include "event.h"
+
+#include <errno.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "logging.h"
+#include "options.h"
+#include "tcp.h"
+#include "usb.h"
+
+#define EVENT_MAX_EVENTS 64
+/* Longest time in milliseconds epoll_wait() may sleep, so that the
+   termination flag and idle connections get looked at regularly. */
+#define EVENT_TICK 500
+/* Seconds of silence after which connections used to be closed regardless
+   of their HTTP state, to count the reconnects the state-aware timeouts
+   avoid. */
+#define EVENT_LEGACY_IDLE_TIMEOUT 5
+/* Timeout in milliseconds for the transfers from the printer. The ones to
+   it adapt to the rate it takes data at, within USB_WRITE_MIN_TIMEOUT and
+   USB_WRITE_MAX_TIMEOUT. */
+#define EVENT_READ_TIMEOUT 5000
+/* Delay in milliseconds before re-reading after an empty response. */
+#define EVENT_INITIAL_BACKOFF 100
+#define EVENT_MAXIMUM_BACKOFF 1000
+/* Time in milliseconds to wait for enough of the first request to tell its
+   traffic class, and the steps in which it is waited for. */
+#define EVENT_CLASSIFY_DELAY 50
+#define EVENT_CLASSIFY_STEP 5
+
+enum event_source_type {
+  EVENT_SOURCE_LISTENER,
+  EVENT_SOURCE_CLIENT,
+  EVENT_SOURCE_TIMER,
+  EVENT_SOURCE_USB
+};
+
+/* Everything registered with epoll is an event_source, its address is what
+   epoll hands back to us. */
+struct event_source {
+  enum event_source_type type;
+  int fd;
+  void *owner;
+  /* Links the sources of the libusb pollfds. */
+  struct event_source *next;
+};
+
+struct event_conn {
+  uint32_t conn_num;
+  struct event_loop *loop;
+  struct tcp_conn_t *tcp;
+  struct usb_conn_t *usb_conn;
+
+  struct event_source client_source;
+  struct event_source timer_source;
+  uint32_t client_events;
+
+  /* Client to printer. The client socket is not read while a packet is on its
+     way to the printer. */
+  struct http_packet_t *out_pkt;
+  size_t out_sent;
+  struct libusb_transfer *out_transfer;
+  int out_inflight;
+  /* When the printer last took data, or the packet was read from the client,
+     and the smoothed rate in bytes per second it took data at, which sets
+     the timeout of the writes. */
+  struct timespec out_progress;
+  double out_rate;
+  /* Times the printer took nothing within that timeout, and the time in
+     microseconds it spent not taking any data. */
+  int out_stalled;
+  uint32_t out_stalls;
+  uint64_t out_stall_time;
+
+  /* Printer to client. The next read is only submitted once the previous
+     response has been fully handed to the client, and only while the client
+     still waits for a response. */
+  struct http_packet_t *in_pkt;
+  size_t in_sent;
+  struct libusb_transfer *in_transfer;
+  int in_inflight;
+  int backoff;
+
+  /* Where the requests and responses passing through begin and end. */
+  struct http_framer request_framer;
+  struct http_framer response_framer;
+
+  time_t last_activity;
+  int closing;
+  /* The client shut down its sending side after its requests. The
+     responses still due are sent before the connection is closed. */
+  int client_eof;
+
+  /* Traffic class of the first request, which tells the interfaces the
+     connection may take, and how long it has been waited for. */
+  enum http_class traffic_class;
+  int classified;
+  int classify_waited;
+  struct timespec queued;
+
+  struct event_conn *prev;
+  struct event_conn *next;
+  /* Links connections waiting for a free USB interface. */
+  struct event_conn *wait_next;
+};
+
+struct event_loop {
+  int epfd;
+  struct usb_sock_t *usb;
+  struct event_source listeners[TCP_LISTENER_MAX];
+  /* libusb pollfds, and the ones removed during the current batch of events
+     which must only be freed after it. */
+  struct event_source *usb_sources;
+  struct event_source *dead_sources;
+  int usb_timeouts_on_fd;
+  /* Milliseconds until a quarantined interface is due to be reset again,
+     -1 if none is */
+  int recover_in;
+
+  struct event_conn *conns;
+  struct event_conn *dead_conns;
+  struct event_conn *wait_head;
+  struct event_conn *wait_tail;
+  uint32_t num_conns;
+  uint32_t next_conn_num;
+  time_t next_sweep;
+  /* Since when no connection has been open, for g_options.exit_idle */
+  time_t idle_since;
+  uint32_t reconnects_avoided;
+};
+
+static time_t event_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Records data passing through |conn| and counts it as a reconnect avoided if
+   the connection would have been closed before for the silence that came
+   before. */
+static void conn_touch(struct event_conn *conn)
+{
+  time_t now = event_now();
+  time_t silence = now - conn->last_activity;
+  conn->last_activity = now;
+  if (silence >= EVENT_LEGACY_IDLE_TIMEOUT) {
+    conn->loop->reconnects_avoided++;
+    NOTE("Conn #%u: Used again after %ld s of silence, %u reconnects "
+         "avoided so far", conn->conn_num, (long)silence,
+         conn->loop->reconnects_avoided);
+  }
+}
+
+static int event_watch(struct event_loop *loop, int op,
+                       struct event_source *source, uint32_t events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = source;
+  if (epoll_ctl(loop->epfd, op, source->fd, &ev)) {
+    ERR("epoll_ctl failed on fd %d with err %d:%s", source->fd, errno,
+        strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void event_unwatch(struct event_loop *loop, struct event_source *source)
+{
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+static void LIBUSB_CALL usb_pollfd_added(int fd, short events,
+                                         void *user_data)
+{
+  struct event_loop *loop = user_data;
+
+  struct event_source *source = calloc(1, sizeof(*source));
+  if (source == NULL) {
+    ERR("Failed to alloc space for libusb pollfd");
+    g_options.terminate = 1;
+    return;
+  }
+  source->type = EVENT_SOURCE_USB;
+  source->fd = fd;
+  source->owner = loop;
+
+  uint32_t epoll_events = 0;
+  if (events & POLLIN)
+    epoll_events |= EPOLLIN;
+  if (events & POLLOUT)
+    epoll_events |= EPOLLOUT;
+
+  if (event_watch(loop, EPOLL_CTL_ADD, source, epoll_events)) {
+    free(source);
+    g_options.terminate = 1;
+    return;
+  }
+  source->next = loop->usb_sources;
+  loop->usb_sources = source;
+}
+
+static void LIBUSB_CALL usb_pollfd_removed(int fd, void *user_data)
+{
+  struct event_loop *loop = user_data;
+  struct event_source **p = &loop->usb_sources;
+
+  while (*p != NULL && (*p)->fd != fd)
+    p = &(*p)->next;
+  if (*p == NULL)
+    return;
+
+  struct event_source *source = *p;
+  *p = source->next;
+  event_unwatch(loop, source);
+  source->next = loop->dead_sources;
+  loop->dead_sources = source;
+}
+
+static void conn_set_events(struct event_conn *conn, uint32_t events)
+{
+  if (conn->client_events == events)
+    return;
+  if (event_watch(conn->loop, EPOLL_CTL_MOD, &conn->client_source, events) == 0)
+    conn->client_events = events;
+}
+
+static void conn_close(struct event_conn *conn);
+
+static void conn_free_if_done(struct event_conn *conn)
+{
+  struct event_loop *loop = conn->loop;
+
+  if (!conn->closing || conn->in_inflight || conn->out_inflight)
+    return;
+
+  /* Unlink, the memory itself is released after the current batch of epoll
+     events, which may still point to it. */
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    loop->conns = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  conn->next = loop->dead_conns;
+  loop->dead_conns = conn;
+  loop->num_conns--;
+
+  if (conn->usb_conn != NULL) {
+    NOTE("Conn #%u: interface #%u: releasing usb conn", conn->conn_num,
+         conn->usb_conn->interface_index);
+    usb_conn_release(conn->usb_conn);
+    conn->usb_conn = NULL;
+  }
+  NOTE("Conn #%u: Printer took data at %.2f MB/s, stalled %u times for "
+       "%.3f s", conn->conn_num, conn->out_rate / 1e6, conn->out_stalls,
+       (double)conn->out_stall_time / 1e6);
+  NOTE("Conn #%u: closed after %u requests in %llu bytes and %u responses "
+       "in %llu bytes, %u connections left", conn->conn_num,
+       conn->request_framer.completed,
+       (unsigned long long)conn->request_framer.bytes,
+       conn->response_framer.completed,
+       (unsigned long long)conn->response_framer.bytes, loop->num_conns);
+}
+
+static void conn_reap(struct event_conn *conn)
+{
+  if (conn->tcp != NULL)
+    tcp_conn_close(conn->tcp);
+  if (conn->timer_source.fd >= 0)
+    close(conn->timer_source.fd);
+  if (conn->out_pkt != NULL)
+    packet_free(conn->out_pkt);
+  if (conn->in_pkt != NULL)
+    packet_free(conn->in_pkt);
+  if (conn->out_transfer != NULL)
+    libusb_free_transfer(conn->out_transfer);
+  if (conn->in_transfer != NULL)
+    libusb_free_transfer(conn->in_transfer);
+  free(conn);
+}
+
+static void conn_close(struct event_conn *conn)
+{
+  struct event_loop *loop = conn->loop;
+
+  if (conn->closing)
+    return;
+  conn->closing = 1;
+
+  /* Drop out of the queue for a USB interface. */
+  struct event_conn **p = &loop->wait_head;
+  struct event_conn *prev = NULL;
+  while (*p != NULL && *p != conn) {
+    prev = *p;
+    p = &(*p)->wait_next;
+  }
+  if (*p != NULL) {
+    *p = conn->wait_next;
+    if (loop->wait_tail == conn)
+      loop->wait_tail = prev;
+  }
+
+  event_unwatch(loop, &conn->client_source);
+  if (conn->timer_source.fd >= 0)
+    event_unwatch(loop, &conn->timer_source);
+
+  /* Pending transfers complete through their callbacks, which finish the
+     clean-up. */
+  if (conn->in_inflight && libusb_cancel_transfer(conn->in_transfer))
+    conn->in_inflight = 0;
+  if (conn->out_inflight && libusb_cancel_transfer(conn->out_transfer))
+    conn->out_inflight = 0;
+
+  conn_free_if_done(conn);
+}
+
+static void in_transfer_callback(struct libusb_transfer *transfer);
+static void out_transfer_callback(struct libusb_transfer *transfer);
+
+static void conn_submit_read(struct event_conn *conn)
+{
+  struct usb_interface *uf = conn->usb_conn->interface;
+
+  libusb_fill_bulk_transfer(conn->in_transfer, conn->usb_conn->parent->printer,
+                            uf->endpoint_in, conn->in_pkt->buffer,
+                            (int)conn->in_pkt->buffer_capacity,
+                            in_transfer_callback, conn, EVENT_READ_TIMEOUT);
+  if (libusb_submit_transfer(conn->in_transfer)) {
+    ERR("Conn #%u: Failed to submit asynchronous USB read", conn->conn_num);
+    conn_close(conn);
+    return;
+  }
+  conn->in_inflight = 1;
+}
+
+static int64_t event_elapsed_us(const struct timespec *from,
+                                const struct timespec *to)
+{
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+    (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Time in milliseconds the rest of the packet should take at the rate the
+   printer took data at so far, with some slack, like the write queue of the
+   threaded mode uses to tell when the printer is stalling. */
+static unsigned int conn_write_timeout(const struct event_conn *conn)
+{
+  if (conn->out_rate <= 0)
+    return USB_WRITE_MAX_TIMEOUT;
+  double left = (double)(conn->out_pkt->filled_size - conn->out_sent);
+  long timeout = (long)(2e3 * left / conn->out_rate);
+  if (timeout < USB_WRITE_MIN_TIMEOUT)
+    return USB_WRITE_MIN_TIMEOUT;
+  if (timeout > USB_WRITE_MAX_TIMEOUT)
+    return USB_WRITE_MAX_TIMEOUT;
+  return (unsigned int)timeout;
+}
+
+static void conn_submit_write(struct event_conn *conn)
+{
+  struct usb_interface *uf = conn->usb_conn->interface;
+
+  libusb_fill_bulk_transfer(
+      conn->out_transfer, conn->usb_conn->parent->printer, uf->endpoint_out,
+      conn->out_pkt->buffer + conn->out_sent,
+      (int)(conn->out_pkt->filled_size - conn->out_sent),
+      out_transfer_callback, conn, conn_write_timeout(conn));
+  if (libusb_submit_transfer(conn->out_transfer)) {
+    ERR("Conn #%u: Failed to submit asynchronous USB write", conn->conn_num);
+    conn_close(conn);
+    return;
+  }
+  conn->out_inflight = 1;
+}
+
+/* Follows the request data in |buf| through the request framer of |conn|,
+   noting every request as it begins. Returns the number of requests which
+   began within it. */
+static uint32_t conn_frame_requests(struct event_conn *conn, const uint8_t *buf,
+                                    size_t len)
+{
+  struct http_framer *framer = &conn->request_framer;
+  enum http_framer_event event;
+  uint32_t started = 0;
+  size_t used = 0;
+
+  do {
+    used += http_framer_next(framer, buf + used, len - used, &event);
+    if (event == HTTP_FRAMER_EVENT_MESSAGE_BEGIN) {
+      started++;
+      NOTE("Conn #%u: Request #%u: %s %s HTTP/1.%d", conn->conn_num,
+           framer->started, framer->method, framer->target,
+           framer->version_minor);
+    }
+  } while (event != HTTP_FRAMER_EVENT_NONE);
+
+  return started;
+}
+
+/* Returns non-zero while the client waits for (the rest of) a response, or
+   when we cannot tell. */
+static int conn_response_pending(struct event_conn *conn)
+{
+  return http_framer_lost(&conn->request_framer) ||
+    http_framer_lost(&conn->response_framer) ||
+    conn->request_framer.started > conn->response_framer.completed;
+}
+
+/* Reads from the printer if a response is due and no read is underway. */
+static void conn_read_if_pending(struct event_conn *conn)
+{
+  if (conn->in_inflight || conn->in_sent != 0 ||
+      conn->in_pkt->filled_size != 0 || !conn_response_pending(conn))
+    return;
+  conn_submit_read(conn);
+}
+
+/* Hands as much of the last printer response to the client as the socket
+   takes, and reads again from the printer once all of it is gone if more of
+   the response is due. */
+static void conn_flush_to_client(struct event_conn *conn)
+{
+  struct http_packet_t *pkt = conn->in_pkt;
+
+  while (conn->in_sent < pkt->filled_size) {
+    ssize_t sent = tcp_conn_send(conn->tcp, pkt->buffer + conn->in_sent,
+                                 pkt->filled_size - conn->in_sent);
+    if (sent < 0) {
+      if (conn->tcp->is_closed) {
+        NOTE("Conn #%u: Client closed connection", conn->conn_num);
+        conn_close(conn);
+      } else {
+        conn_set_events(conn, conn->client_events | EPOLLOUT);
+      }
+      return;
+    }
+    conn->in_sent += (size_t)sent;
+  }
+
+  NOTE("Conn #%u: TCP: sent %zu bytes", conn->conn_num, pkt->filled_size);
+  pkt->filled_size = 0;
+  conn->in_sent = 0;
+  conn_set_events(conn, conn->client_events & ~(uint32_t)EPOLLOUT);
+  if (conn->client_eof && !conn_response_pending(conn)) {
+    NOTE("Conn #%u: All responses sent to the half-closed client, closing",
+         conn->conn_num);
+    conn_close(conn);
+    return;
+  }
+  conn_read_if_pending(conn);
+}
+
+static void conn_schedule_read(struct event_conn *conn)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = conn->backoff / 1000;
+  its.it_value.tv_nsec = (long)(conn->backoff % 1000) * 1000000;
+  if (timerfd_settime(conn->timer_source.fd, 0, &its, NULL)) {
+    conn_submit_read(conn);
+    return;
+  }
+
+  conn->backoff *= 2;
+  if (conn->backoff > EVENT_MAXIMUM_BACKOFF)
+    conn->backoff = EVENT_MAXIMUM_BACKOFF;
+}
+
+static void in_transfer_callback(struct libusb_transfer *transfer)
+{
+  struct event_conn *conn = transfer->user_data;
+  conn->in_inflight = 0;
+
+  if (conn->closing) {
+    conn_free_if_done(conn);
+    return;
+  }
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      if (transfer->actual_length > 0) {
+        NOTE("Conn #%u: Pkt from usb (buffer size: %d)", conn->conn_num,
+             transfer->actual_length);
+        conn->in_pkt->filled_size = (size_t)transfer->actual_length;
+        conn->in_sent = 0;
+        http_framer_feed(&conn->response_framer, conn->in_pkt->buffer,
+                         conn->in_pkt->filled_size);
+        conn->backoff = EVENT_INITIAL_BACKOFF;
+        conn_touch(conn);
+        conn_flush_to_client(conn);
+      } else if (conn_response_pending(conn)) {
+        conn_schedule_read(conn);
+      }
+      break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      conn_read_if_pending(conn);
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      NOTE("Conn #%u: The transfer was cancelled", conn->conn_num);
+      conn_close(conn);
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      ERR("Conn #%u: The printer was disconnected during the transfer",
+          conn->conn_num);
+      g_options.terminate = 1;
+      conn_close(conn);
+      break;
+    default:
+      ERR("Conn #%u: Reading from the printer failed with status %d",
+          conn->conn_num, transfer->status);
+      conn->usb_conn->is_staled = 1;
+      conn_close(conn);
+  }
+}
+
+static void out_transfer_callback(struct libusb_transfer *transfer)
+{
+  struct event_conn *conn = transfer->user_data;
+  conn->out_inflight = 0;
+
+  if (conn->closing) {
+    conn_free_if_done(conn);
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsed = event_elapsed_us(&conn->out_progress, &now);
+  if (transfer->actual_length > 0) {
+    if (conn->out_stalled) {
+      conn->out_stall_time += (uint64_t)elapsed;
+      conn->out_stalled = 0;
+    }
+    if (elapsed > 0) {
+      double rate = (double)transfer->actual_length * 1e6 / (double)elapsed;
+      conn->out_rate = conn->out_rate > 0 ?
+        (3 * conn->out_rate + rate) / 4 : rate;
+    }
+    conn->out_progress = now;
+  }
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      /* A write which timed out is simply continued, it is the only one in
+         flight, so no data behind it can overtake it. */
+      if (transfer->actual_length == 0) {
+        if (!conn->out_stalled) {
+          NOTE("Conn #%u: Printer takes no data for %u ms, stalling",
+               conn->conn_num, transfer->timeout);
+          conn->out_stalled = 1;
+          conn->out_stalls++;
+        }
+        if (elapsed > (int64_t)PRINTER_CRASH_TIMEOUT_RECEIVE * 1000000) {
+          ERR("Conn #%u: Usb send fully timed out", conn->conn_num);
+          conn->out_stall_time += (uint64_t)elapsed;
+          conn->out_stalled = 0;
+          conn_close(conn);
+          return;
+        }
+      }
+      /* fall through */
+    case LIBUSB_TRANSFER_COMPLETED:
+      conn->out_sent += (size_t)transfer->actual_length;
+      if (conn->out_sent < conn->out_pkt->filled_size) {
+        conn_submit_write(conn);
+        return;
+      }
+      NOTE("Conn #%u: USB: sent %zu bytes in total", conn->conn_num,
+           conn->out_sent);
+      /* A new request reached the printer, read its response without
+         waiting out the backoff of the previous one. */
+      if (conn_frame_requests(conn, conn->out_pkt->buffer,
+                              conn->out_pkt->filled_size))
+        conn->backoff = EVENT_INITIAL_BACKOFF;
+      conn_read_if_pending(conn);
+      conn->out_pkt->filled_size = 0;
+      conn->out_sent = 0;
+      conn_set_events(conn, conn->client_events | EPOLLIN);
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      ERR("Conn #%u: Printer has been disconnected", conn->conn_num);
+      g_options.terminate = 1;
+      conn_close(conn);
+      break;
+    default:
+      ERR("Conn #%u: USB: send failed with status %d", conn->conn_num,
+          transfer->status);
+      conn->usb_conn->is_staled = 1;
+      conn_close(conn);
+  }
+}
+
+static void conn_start(struct event_conn *conn)
+{
+  NOTE("Conn #%u: interface #%u: acquired usb conn", conn->conn_num,
+       conn->usb_conn->interface_index);
+  /* Disarm the timeout of the wait */
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  timerfd_settime(conn->timer_source.fd, 0, &its, NULL);
+  conn->last_activity = event_now();
+  conn_set_events(conn, EPOLLIN);
+}
+
+/* Gives interfaces which became free to the connections waiting longest
+   which may take them. */
+static void event_serve_waiting(struct event_loop *loop)
+{
+  struct event_conn **link = &loop->wait_head;
+  struct event_conn *prev = NULL;
+
+  while (*link != NULL) {
+    struct event_conn *conn = *link;
+    conn->usb_conn = usb_conn_try_acquire(loop->usb, conn->traffic_class,
+                                          &conn->queued);
+    if (conn->usb_conn == NULL) {
+      /* Interactive requests may take any interface, so none is free. Bulk
+         ones leave the reserved ones to the interactive ones behind them. */
+      if (conn->traffic_class == HTTP_CLASS_INTERACTIVE)
+        return;
+      prev = conn;
+      link = &conn->wait_next;
+      continue;
+    }
+    *link = conn->wait_next;
+    if (loop->wait_tail == conn)
+      loop->wait_tail = prev;
+    conn->wait_next = NULL;
+    conn_start(conn);
+  }
+}
+
+/* Tells the traffic class of the first request of |conn| once enough of it
+   arrived, or |EVENT_CLASSIFY_DELAY| has passed, and puts the connection in
+   line for an interface. */
+static void conn_classify(struct event_conn *conn)
+{
+  struct event_loop *loop = conn->loop;
+  uint8_t start[HTTP_CLASSIFY_MAX];
+
+  ssize_t len = tcp_conn_peek(conn->tcp, start, sizeof(start));
+  if (len < 0 && !conn->tcp->is_closed)
+    return;
+  if (len <= 0) {
+    NOTE("Conn #%u: Client closed connection", conn->conn_num);
+    conn_close(conn);
+    return;
+  }
+
+  if (http_classify(start, (size_t)len, &conn->traffic_class) &&
+      (size_t)len < sizeof(start) &&
+      conn->classify_waited < EVENT_CLASSIFY_DELAY) {
+    /* Look again once more may have arrived */
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = EVENT_CLASSIFY_STEP * 1000000L;
+    if (timerfd_settime(conn->timer_source.fd, 0, &its, NULL) == 0) {
+      conn->classify_waited += EVENT_CLASSIFY_STEP;
+      conn_set_events(conn, EPOLLRDHUP);
+      return;
+    }
+  }
+
+  conn->classified = 1;
+  NOTE("Conn #%u: %s request", conn->conn_num,
+       http_class_name(conn->traffic_class));
+
+  /* Only a hang-up is of interest until an interface is ours. */
+  conn_set_events(conn, EPOLLRDHUP);
+  clock_gettime(CLOCK_MONOTONIC, &conn->queued);
+  if (loop->wait_tail != NULL)
+    loop->wait_tail->wait_next = conn;
+  else
+    loop->wait_head = conn;
+  loop->wait_tail = conn;
+  event_serve_waiting(loop);
+  if (conn->usb_conn != NULL)
+    return;
+  NOTE("Conn #%u: All USB interfaces for %s requests busy, waiting ...",
+       conn->conn_num, http_class_name(conn->traffic_class));
+
+  /* Give up after as long as usb_conn_acquire() would */
+  if (g_options.acquire_timeout) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)g_options.acquire_timeout;
+    if (timerfd_settime(conn->timer_source.fd, 0, &its, NULL))
+      ERR("Conn #%u: Failed to set the timeout of the wait for an "
+          "interface", conn->conn_num);
+  }
+}
+
+static void conn_readable(struct event_conn *conn)
+{
+  ssize_t gotten_size = tcp_conn_recv(conn->tcp, conn->out_pkt);
+  if (gotten_size < 0 && !conn->tcp->is_closed)
+    return;
+  if (gotten_size == 0 && conn_response_pending(conn) &&
+      !http_framer_lost(&conn->request_framer) &&
+      !http_framer_lost(&conn->response_framer)) {
+    /* A half-close, the client still waits for its responses */
+    NOTE("Conn #%u: Client finished sending, still sending responses",
+         conn->conn_num);
+    conn->client_eof = 1;
+    conn_set_events(conn, conn->client_events & ~(uint32_t)EPOLLIN);
+    return;
+  }
+  if (conn->tcp->is_closed) {
+    NOTE("Conn #%u: Client closed connection", conn->conn_num);
+    conn_close(conn);
+    return;
+  }
+
+  NOTE("Conn #%u: Pkt from tcp (buffer size: %zu)", conn->conn_num,
+       conn->out_pkt->filled_size);
+  conn_touch(conn);
+  conn->out_sent = 0;
+  clock_gettime(CLOCK_MONOTONIC, &conn->out_progress);
+
+  /* Stop reading from the client until the printer took this packet. */
+  conn_set_events(conn, conn->client_events & ~(uint32_t)EPOLLIN);
+  conn_submit_write(conn);
+}
+
+static void conn_handle(struct event_conn *conn, uint32_t events)
+{
+  if (conn->closing)
+    return;
+
+  if (conn->usb_conn == NULL) {
+    /* The first request tells which interfaces the connection may take. */
+    if (!conn->classified && (events & EPOLLIN)) {
+      conn_classify(conn);
+      return;
+    }
+    /* Still queued for an interface, all we expect is a hang-up. */
+    if (events & (EPOLLHUP | EPOLLERR)) {
+      NOTE("Conn #%u: Client left while waiting for an interface",
+           conn->conn_num);
+      conn_close(conn);
+    } else if (events & EPOLLRDHUP) {
+      /* A half-close, legal once the request is sent, which still gets its
+         response. The socket is read again once an interface is ours. */
+      NOTE("Conn #%u: Client finished sending while waiting for an "
+           "interface", conn->conn_num);
+      conn_set_events(conn, 0);
+    }
+    return;
+  }
+
+  if ((events & EPOLLIN) && (conn->client_events & EPOLLIN))
+    conn_readable(conn);
+  if (!conn->closing && (events & EPOLLOUT) &&
+      (conn->client_events & EPOLLOUT))
+    conn_flush_to_client(conn);
+  if (!conn->closing && (events & (EPOLLHUP | EPOLLERR))) {
+    NOTE("Conn #%u: Client closed connection", conn->conn_num);
+    conn_close(conn);
+  }
+}
+
+static void conn_timer_expired(struct event_conn *conn)
+{
+  uint64_t expirations;
+  if (read(conn->timer_source.fd, &expirations, sizeof(expirations)) < 0)
+    return;
+  if (conn->closing)
+    return;
+  if (conn->usb_conn == NULL) {
+    if (!conn->classified) {
+      /* Look at the start of the first request again */
+      conn_set_events(conn, EPOLLIN | EPOLLRDHUP);
+    } else {
+      ERR("Conn #%u: Timed out waiting for a free USB interface",
+          conn->conn_num);
+      conn_close(conn);
+    }
+    return;
+  }
+  conn_read_if_pending(conn);
+}
+
+static struct event_conn *conn_new(struct event_loop *loop,
+                                   struct tcp_conn_t *tcp)
+{
+  struct event_conn *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL) {
+    ERR("Failed to alloc space for connection");
+    tcp_conn_close(tcp);
+    return NULL;
+  }
+
+  conn->loop = loop;
+  conn->tcp = tcp;
+  conn->conn_num = loop->next_conn_num++;
+  conn->backoff = EVENT_INITIAL_BACKOFF;
+  http_framer_init(&conn->response_framer, 1, NULL);
+  http_framer_init(&conn->request_framer, 0, &conn->response_framer);
+  conn->client_source.type = EVENT_SOURCE_CLIENT;
+  conn->client_source.fd = tcp->sd;
+  conn->client_source.owner = conn;
+  conn->timer_source.type = EVENT_SOURCE_TIMER;
+  conn->timer_source.owner = conn;
+  conn->timer_source.fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  conn->out_pkt = packet_new();
+  conn->in_pkt = packet_new();
+  conn->out_transfer = libusb_alloc_transfer(0);
+  conn->in_transfer = libusb_alloc_transfer(0);
+  if (conn->timer_source.fd < 0 || conn->out_pkt == NULL ||
+      conn->in_pkt == NULL || conn->out_transfer == NULL ||
+      conn->in_transfer == NULL) {
+    ERR("Conn #%u: Failed to alloc connection state", conn->conn_num);
+    goto error;
+  }
+
+  /* Until an interface is ours only the start of the first request and a
+     hang-up are of interest. */
+  conn->last_activity = event_now();
+  conn->client_events = EPOLLIN | EPOLLRDHUP;
+  if (event_watch(loop, EPOLL_CTL_ADD, &conn->client_source,
+                  conn->client_events))
+    goto error;
+  if (event_watch(loop, EPOLL_CTL_ADD, &conn->timer_source, EPOLLIN)) {
+    event_unwatch(loop, &conn->client_source);
+    goto error;
+  }
+
+  conn->next = loop->conns;
+  if (loop->conns != NULL)
+    loop->conns->prev = conn;
+  loop->conns = conn;
+  loop->num_conns++;
+  return conn;
+
+ error:
+  conn_reap(conn);
+  return NULL;
+}
+
+static void event_accept(struct event_loop *loop, struct tcp_sock_t *sock)
+{
+  struct tcp_conn_t *tcp;
+
+  while (!g_options.terminate && (tcp = tcp_conn_accept(sock)) != NULL) {
+    struct event_conn *conn = conn_new(loop, tcp);
+    if (conn == NULL)
+      continue;
+
+    NOTE("Conn #%u: accepted, %u connections open", conn->conn_num,
+         loop->num_conns);
+  }
+}
+
+/* Closes connections which saw no traffic in either direction for longer
+   than their HTTP state allows, just like the threaded mode does, and stops
+   the loop once there were none for g_options.exit_idle seconds. */
+static void event_sweep_idle(struct event_loop *loop)
+{
+  time_t now = event_now();
+  if (now < loop->next_sweep)
+    return;
+  loop->next_sweep = now + 1;
+
+  if (loop->num_conns > 0) {
+    loop->idle_since = now;
+  } else if (g_options.exit_idle &&
+             now - loop->idle_since >= (time_t)g_options.exit_idle) {
+    NOTE("No client for %u s, exiting until the next one comes",
+         g_options.exit_idle);
+    g_options.idle_exit = 1;
+    g_options.terminate = 1;
+    return;
+  }
+
+  struct event_conn *conn = loop->conns;
+  while (conn != NULL) {
+    struct event_conn *next = conn->next;
+    /* Connections which never sent a request time out as well. */
+    int idle = conn->usb_conn != NULL ?
+        !conn->out_inflight && conn->in_pkt->filled_size == 0 :
+        !conn->classified;
+    enum http_exchange_state state =
+        http_exchange_state(&conn->request_framer, &conn->response_framer);
+    if (!conn->closing && idle &&
+        now - conn->last_activity >= (time_t)http_exchange_timeout(state)) {
+      NOTE("Conn #%u: Silent for %ld s %s, closing", conn->conn_num,
+           (long)(now - conn->last_activity),
+           http_exchange_state_name(state));
+      conn_close(conn);
+    }
+    conn = next;
+  }
+}
+
+static void event_reap(struct event_loop *loop)
+{
+  while (loop->dead_conns != NULL) {
+    struct event_conn *conn = loop->dead_conns;
+    loop->dead_conns = conn->next;
+    conn_reap(conn);
+  }
+  while (loop->dead_sources != NULL) {
+    struct event_source *source = loop->dead_sources;
+    loop->dead_sources = source->next;
+    free(source);
+  }
+  event_serve_waiting(loop);
+}
+
+static void event_handle_usb(struct event_loop *loop)
+{
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  libusb_handle_events_timeout_completed(loop->usb->context, &tv, NULL);
+}
+
+static int event_wait_timeout(struct event_loop *loop)
+{
+  int timeout = EVENT_TICK;
+  struct timeval tv;
+
+  if (!loop->usb_timeouts_on_fd &&
+      libusb_get_next_timeout(loop->usb->context, &tv) == 1) {
+    long usb_timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    if (usb_timeout < timeout)
+      timeout = (int)usb_timeout;
+  }
+  if (loop->recover_in >= 0 && loop->recover_in < timeout)
+    timeout = loop->recover_in;
+  return timeout;
+}
+
+static int event_dispatch(struct event_loop *loop, int timeout)
+{
+  struct epoll_event events[EVENT_MAX_EVENTS];
+  int usb_ready = 0;
+
+  int n = epoll_wait(loop->epfd, events, EVENT_MAX_EVENTS, timeout);
+  if (n < 0) {
+    if (errno == EINTR)
+      return 0;
+    ERR("epoll_wait failed with err %d:%s", errno, strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct event_source *source = events[i].data.ptr;
+    switch (source->type) {
+      case EVENT_SOURCE_LISTENER:
+        event_accept(loop, source->owner);
+        break;
+      case EVENT_SOURCE_CLIENT:
+        conn_handle(source->owner, events[i].events);
+        break;
+      case EVENT_SOURCE_TIMER:
+        conn_timer_expired(source->owner);
+        break;
+      case EVENT_SOURCE_USB:
+        usb_ready = 1;
+        break;
+    }
+  }
+
+  if (usb_ready || !loop->usb_timeouts_on_fd)
+    event_handle_usb(loop);
+
+  return 0;
+}
+
+int event_loop_run(struct usb_sock_t *usb)
+{
+  struct event_loop loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.usb = usb;
+  loop.next_conn_num = 1;
+  loop.recover_in = -1;
+  loop.idle_since = event_now();
+
+  loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop.epfd < 0) {
+    ERR("Failed to create epoll instance");
+    return -1;
+  }
+
+  struct tcp_sock_t *socks[TCP_LISTENER_MAX] = {
+    g_options.tcp_socket, g_options.tcp6_socket, g_options.unix_socket
+  };
+  for (int i = 0; i < TCP_LISTENER_MAX; i++) {
+    if (socks[i] == NULL)
+      continue;
+    loop.listeners[i].type = EVENT_SOURCE_LISTENER;
+    loop.listeners[i].fd = socks[i]->sd;
+    loop.listeners[i].owner = socks[i];
+    if (tcp_sock_set_nonblocking(socks[i]) ||
+        event_watch(&loop, EPOLL_CTL_ADD, &loop.listeners[i], EPOLLIN))
+      goto error;
+  }
+
+  /* Watch the file descriptors libusb has now and those it opens later. */
+  const struct libusb_pollfd **pollfds = libusb_get_pollfds(usb->context);
+  if (pollfds == NULL) {
+    ERR("libusb does not expose its file descriptors on this platform");
+    goto error;
+  }
+  for (int i = 0; pollfds[i] != NULL; i++)
+    usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, &loop);
+  libusb_free_pollfds(pollfds);
+  libusb_set_pollfd_notifiers(usb->context, usb_pollfd_added,
+                              usb_pollfd_removed, &loop);
+  loop.usb_timeouts_on_fd = libusb_pollfds_handle_timeouts(usb->context);
+
+  NOTE("Event loop running");
+  while (!g_options.terminate) {
+    if (event_dispatch(&loop, event_wait_timeout(&loop)))
+      break;
+    event_sweep_idle(&loop);
+    /* Quarantined interfaces are reset here when they are due, outside of
+       any transfer callback, before waiting connections are served. */
+    loop.recover_in = usb_recover_interfaces(usb);
+    event_reap(&loop);
+  }
+  NOTE("Event loop shutting down, %u connections open", loop.num_conns);
+
+  /* Close everything and give the cancelled transfers a moment to come back
+     before their memory goes away. */
+  loop.wait_head = NULL;
+  loop.wait_tail = NULL;
+  for (struct event_conn *conn = loop.conns; conn != NULL;) {
+    struct event_conn *next = conn->next;
+    conn_close(conn);
+    conn = next;
+  }
+  for (int i = 0; i < 20 && loop.conns != NULL; i++) {
+    event_dispatch(&loop, 100);
+    event_reap(&loop);
+  }
+  event_reap(&loop);
+  if (loop.conns != NULL)
+    ERR("%u connections did not shut down in time", loop.num_conns);
+
+  libusb_set_pollfd_notifiers(usb->context, NULL, NULL, NULL);
+  while (loop.usb_sources != NULL) {
+    struct event_source *source = loop.usb_sources;
+    loop.usb_sources = source->next;
+    free(source);
+  }
+  close(loop.epfd);
+  return 0;
+
+ error:
+  close(loop.epfd);
+  return -1;
+}
@@ -0,0 +1,25 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+
+#include "usb.h"
+
+/* Runs the single-threaded proxy engine until g_options.terminate is set.
+   The listening sockets, every client connection and the pollfds of the
+   libusb context of |usb| are multiplexed in one epoll loop, and USB
+   transfers are driven by their completion callbacks instead of by a pair of
+   threads per connection. Returns 0 on shutdown and a non-zero value if the
+   loop could not be set up. */
+int event_loop_run(struct usb_sock_t *usb);
@@ -19,11 +19,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <strings.h>
 
 #include <limits.h>
 
 #include "http.h"
 #include "logging.h"
+#include "options.h"
 
 #define BUFFER_STEP (1 << 15)
 
@@ -57,3 +59,477 @@ void packet_free(struct http_packet_t *pkt)
   free(pkt->buffer);
   free(pkt);
 }
+
+void http_framer_init(struct http_framer *framer, int is_response,
+		      struct http_framer *peer)
+{
+  memset(framer, 0, sizeof(*framer));
+  framer->is_response = is_response;
+  framer->state = HTTP_FRAMER_START_LINE;
+  framer->peer = peer;
+}
+
+int http_framer_lost(const struct http_framer *framer)
+{
+  return framer->state == HTTP_FRAMER_ERROR ||
+    framer->state == HTTP_FRAMER_UNTIL_CLOSE;
+}
+
+int http_framer_idle(const struct http_framer *framer)
+{
+  return framer->state == HTTP_FRAMER_START_LINE && framer->line_len == 0;
+}
+
+int http_framer_ipp_code(const struct http_framer *framer)
+{
+  /* version-number (2 bytes), then operation-id or status-code (2 bytes) */
+  if (!framer->is_ipp || framer->body_head_len < 4)
+    return -1;
+  return (framer->body_head[2] << 8) | framer->body_head[3];
+}
+
+static void framer_reset_message(struct http_framer *framer)
+{
+  framer->state = HTTP_FRAMER_START_LINE;
+  framer->remaining = 0;
+  framer->chunked = 0;
+  framer->has_length = 0;
+}
+
+/* Copies the |len| bytes at |src| into |dst| of |size| bytes, truncated and
+   terminated. */
+static void framer_copy_field(char *dst, size_t size, const char *src,
+			      size_t len)
+{
+  if (len >= size)
+    len = size - 1;
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+/* Reads the minor version of "HTTP/1.x" at |version|, returns -1 if it is
+   not HTTP/1. */
+static int framer_version(const char *version)
+{
+  if (strncmp(version, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)version[7]))
+    return -1;
+  return version[7] - '0';
+}
+
+static enum http_framer_event framer_start_line(struct http_framer *framer)
+{
+  char *line = framer->line;
+
+  /* Empty lines between messages are to be ignored */
+  if (framer->line_len == 0)
+    return HTTP_FRAMER_EVENT_NONE;
+
+  framer->is_ipp = 0;
+  framer->body_head_len = 0;
+  if (framer->is_response) {
+    int minor = framer_version(line);
+    char *code = strchr(line, ' ');
+    if (minor < 0 || code == NULL || !isdigit((unsigned char)code[1]))
+      goto error;
+    framer->version_minor = minor;
+    framer->keep_alive = minor > 0;
+    framer->status = atoi(code + 1);
+    framer->state = HTTP_FRAMER_HEADERS;
+    /* Interim responses are no message of their own */
+    if (framer->status < 200)
+      return HTTP_FRAMER_EVENT_NONE;
+    framer->started++;
+    return HTTP_FRAMER_EVENT_MESSAGE_BEGIN;
+  }
+
+  /* method SP request-target SP HTTP-version */
+  char *target = strchr(line, ' ');
+  if (target == NULL)
+    goto error;
+  char *version = strchr(target + 1, ' ');
+  framer_copy_field(framer->method, sizeof(framer->method), line,
+		    (size_t)(target - line));
+  framer_copy_field(framer->target, sizeof(framer->target), target + 1,
+		    version != NULL ? (size_t)(version - target - 1) :
+		    strlen(target + 1));
+  /* A truncated line or HTTP/0.9 have no version to read */
+  int minor = version != NULL ? framer_version(version + 1) : -1;
+  framer->version_minor = minor < 0 ? 1 : minor;
+  framer->keep_alive = framer->version_minor > 0;
+  framer->status = 0;
+  framer->started++;
+
+  /* Tell the response framer what to expect. Beyond the requests its mask
+     can tell about it would mistake bodiless responses for ones with a
+     body, so it gives up, and the connection is passed through as is. */
+  struct http_framer *peer = framer->peer;
+  if (peer != NULL && peer->state != HTTP_FRAMER_ERROR) {
+    if (peer->num_expected >= 32) {
+      NOTE("HTTP: More than 32 requests awaiting their responses, no "
+	   "longer following them");
+      peer->state = HTTP_FRAMER_ERROR;
+    } else {
+      if (strcmp(framer->method, "HEAD") == 0)
+	peer->no_body_mask |= 1u << peer->num_expected;
+      peer->num_expected++;
+    }
+  }
+
+  framer->state = HTTP_FRAMER_HEADERS;
+  return HTTP_FRAMER_EVENT_MESSAGE_BEGIN;
+
+ error:
+  NOTE("HTTP: Lost track of messages at \"%.32s\"", line);
+  framer->state = HTTP_FRAMER_ERROR;
+  return HTTP_FRAMER_EVENT_NONE;
+}
+
+static enum http_framer_event framer_headers_done(struct http_framer *framer)
+{
+  int no_body = 0;
+
+  if (framer->is_response) {
+    if (framer->status < 200) {
+      /* Interim response, the actual one follows */
+      framer_reset_message(framer);
+      return HTTP_FRAMER_EVENT_NONE;
+    }
+    if (framer->num_expected > 0) {
+      no_body = framer->no_body_mask & 1u;
+      framer->no_body_mask >>= 1;
+      framer->num_expected--;
+    }
+    if (framer->status == 204 || framer->status == 304)
+      no_body = 1;
+  }
+
+  if (!no_body && framer->chunked) {
+    framer->state = HTTP_FRAMER_CHUNK_SIZE;
+  } else if (!no_body && framer->has_length && framer->remaining > 0) {
+    framer->state = HTTP_FRAMER_BODY;
+  } else if (!no_body && !framer->has_length && framer->is_response) {
+    framer->state = HTTP_FRAMER_UNTIL_CLOSE;
+  } else {
+    /* The message ends with its headers, which is told by the next call */
+    framer_reset_message(framer);
+    framer->end_pending = 1;
+  }
+  return HTTP_FRAMER_EVENT_HEADERS_END;
+}
+
+static enum http_framer_event framer_header(struct http_framer *framer)
+{
+  char *line = framer->line;
+
+  if (framer->line_len == 0)
+    return framer_headers_done(framer);
+
+  if (strncasecmp(line, "Content-Length:", 15) == 0) {
+    char *end;
+    unsigned long long length = strtoull(line + 15, &end, 10);
+    if (end == line + 15) {
+      framer->state = HTTP_FRAMER_ERROR;
+      return HTTP_FRAMER_EVENT_NONE;
+    }
+    framer->has_length = 1;
+    framer->remaining = (size_t)length;
+  } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+    for (char *p = line + 18; *p; p++)
+      if (strncasecmp(p, "chunked", 7) == 0)
+	framer->chunked = 1;
+  } else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+    char *type = line + 13;
+    while (*type == ' ' || *type == '\t')
+      type++;
+    framer->is_ipp = strncasecmp(type, "application/ipp", 15) == 0;
+  } else if (strncasecmp(line, "Connection:", 11) == 0) {
+    for (char *p = line + 11; *p; p++) {
+      if (strncasecmp(p, "close", 5) == 0)
+	framer->keep_alive = 0;
+      else if (strncasecmp(p, "keep-alive", 10) == 0)
+	framer->keep_alive = 1;
+    }
+  }
+
+  return HTTP_FRAMER_EVENT_NONE;
+}
+
+static enum http_framer_event framer_line(struct http_framer *framer)
+{
+  switch (framer->state) {
+  case HTTP_FRAMER_START_LINE:
+    return framer_start_line(framer);
+  case HTTP_FRAMER_HEADERS:
+    return framer_header(framer);
+  case HTTP_FRAMER_CHUNK_SIZE:
+    {
+      /* Chunk extensions after the size are ignored */
+      char *end;
+      unsigned long long size = strtoull(framer->line, &end, 16);
+      if (end == framer->line) {
+	framer->state = HTTP_FRAMER_ERROR;
+	return HTTP_FRAMER_EVENT_NONE;
+      }
+      framer->remaining = (size_t)size;
+      framer->state = size ? HTTP_FRAMER_CHUNK_DATA : HTTP_FRAMER_TRAILERS;
+      return HTTP_FRAMER_EVENT_NONE;
+    }
+  case HTTP_FRAMER_CHUNK_END:
+    /* The CRLF which terminates the chunk data */
+    if (framer->line_len != 0) {
+      framer->state = HTTP_FRAMER_ERROR;
+      return HTTP_FRAMER_EVENT_NONE;
+    }
+    framer->state = HTTP_FRAMER_CHUNK_SIZE;
+    return HTTP_FRAMER_EVENT_NONE;
+  case HTTP_FRAMER_TRAILERS:
+    if (framer->line_len != 0)
+      return HTTP_FRAMER_EVENT_NONE;
+    framer_reset_message(framer);
+    framer->completed++;
+    return HTTP_FRAMER_EVENT_MESSAGE_END;
+  default:
+    return HTTP_FRAMER_EVENT_NONE;
+  }
+}
+
+size_t http_framer_next(struct http_framer *framer, const uint8_t *buf,
+			size_t len, enum http_framer_event *event)
+{
+  size_t i = 0;
+
+  if (framer->end_pending) {
+    framer->end_pending = 0;
+    framer->completed++;
+    *event = HTTP_FRAMER_EVENT_MESSAGE_END;
+    return 0;
+  }
+
+  *event = HTTP_FRAMER_EVENT_NONE;
+  while (i < len) {
+    switch (framer->state) {
+    case HTTP_FRAMER_ERROR:
+    case HTTP_FRAMER_UNTIL_CLOSE:
+      /* Nothing more to tell */
+      i = len;
+      break;
+
+    case HTTP_FRAMER_BODY:
+    case HTTP_FRAMER_CHUNK_DATA:
+      {
+	/* Skip over payload without looking at it */
+	size_t take = len - i;
+	if (take > framer->remaining)
+	  take = framer->remaining;
+	if (framer->body_head_len < HTTP_BODY_HEAD_MAX) {
+	  size_t keep = HTTP_BODY_HEAD_MAX - framer->body_head_len;
+	  if (keep > take)
+	    keep = take;
+	  memcpy(framer->body_head + framer->body_head_len, buf + i, keep);
+	  framer->body_head_len += keep;
+	}
+	i += take;
+	framer->remaining -= take;
+	if (framer->remaining > 0)
+	  break;
+	if (framer->state == HTTP_FRAMER_CHUNK_DATA) {
+	  framer->state = HTTP_FRAMER_CHUNK_END;
+	  break;
+	}
+	framer_reset_message(framer);
+	framer->completed++;
+	*event = HTTP_FRAMER_EVENT_MESSAGE_END;
+	goto done;
+      }
+
+    default:
+      {
+	/* Take the line up to its end, or all there is of it so far */
+	const uint8_t *eol = memchr(buf + i, '\n', len - i);
+	size_t run = (eol != NULL ? (size_t)(eol - buf) : len) - i;
+	size_t room = HTTP_LINE_MAX - 1 - framer->line_len;
+	memcpy(framer->line + framer->line_len, buf + i,
+	       run < room ? run : room);
+	framer->line_len += run < room ? run : room;
+	i += run;
+	if (eol == NULL)
+	  break;
+	i++;
+
+	/* Tolerate bare LF line endings */
+	if (framer->line_len > 0 && framer->line[framer->line_len - 1] == '\r')
+	  framer->line_len--;
+	framer->line[framer->line_len] = '\0';
+	*event = framer_line(framer);
+	framer->line_len = 0;
+	if (*event != HTTP_FRAMER_EVENT_NONE)
+	  goto done;
+	break;
+      }
+    }
+  }
+
+ done:
+  framer->bytes += i;
+  return i;
+}
+
+uint32_t http_framer_feed(struct http_framer *framer, const uint8_t *buf,
+			  size_t len)
+{
+  uint32_t ended = 0;
+  size_t used = 0;
+  enum http_framer_event event;
+
+  do {
+    used += http_framer_next(framer, buf + used, len - used, &event);
+    if (event == HTTP_FRAMER_EVENT_MESSAGE_END)
+      ended++;
+  } while (event != HTTP_FRAMER_EVENT_NONE);
+
+  return ended;
+}
+
+
+/* Finds the IPP operation-id of the request whose body starts at |body|,
+   skipping the size line of the first chunk if it is |chunked|. Returns -1 if
+   it has not been received yet. */
+static int classify_ipp_operation(const char *body, size_t len, int chunked)
+{
+  if (chunked) {
+    const char *eol = memchr(body, '\n', len);
+    if (eol == NULL)
+      return -1;
+    len -= (size_t)(eol + 1 - body);
+    body = eol + 1;
+  }
+
+  /* version-number (2 bytes), then operation-id (2 bytes) */
+  if (len < 4)
+    return -1;
+  return ((unsigned char)body[2] << 8) | (unsigned char)body[3];
+}
+
+int http_classify(const uint8_t *buf, size_t len, enum http_class *class)
+{
+  const char *data = (const char *)buf;
+
+  /* Requests which cannot be told are taken for bulk ones, so that they do
+     not occupy the interfaces reserved for interactive ones. */
+  *class = HTTP_CLASS_BULK;
+
+  /* Empty lines between messages are to be ignored */
+  while (len > 0 && (*data == '\r' || *data == '\n')) {
+    data++;
+    len--;
+  }
+
+  const char *eol = memchr(data, '\n', len);
+  if (eol == NULL)
+    return -1;
+  const char *path = memchr(data, ' ', (size_t)(eol - data));
+  if (path == NULL)
+    return 0;
+  size_t method_len = (size_t)(path - data);
+  path++;
+  const char *path_end = memchr(path, ' ', (size_t)(eol - path));
+  if (path_end == NULL)
+    path_end = eol;
+  size_t path_len = (size_t)(path_end - path);
+
+  if (path_len >= 5 && strncmp(path, "/eSCL", 5) == 0) {
+    /* Scan jobs and the documents they produce are bulk, status and
+       capability queries are not. */
+    if (memmem(path, path_len, "/ScanJobs", 9) == NULL)
+      *class = HTTP_CLASS_INTERACTIVE;
+    return 0;
+  }
+
+  if ((method_len == 3 && strncmp(data, "GET", 3) == 0) ||
+      (method_len == 4 && strncmp(data, "HEAD", 4) == 0)) {
+    /* The web interface and icons */
+    *class = HTTP_CLASS_INTERACTIVE;
+    return 0;
+  }
+
+  if (!(method_len == 4 && strncmp(data, "POST", 4) == 0) ||
+      path_len < 4 || strncmp(path, "/ipp", 4) != 0)
+    return 0;
+
+  /* IPP, the operation tells. The framer finds where the body starts, as
+     it does for the requests passing through. */
+  struct http_framer framer;
+  enum http_framer_event event;
+  size_t used = 0;
+  http_framer_init(&framer, 0, NULL);
+  do {
+    used += http_framer_next(&framer, buf + used, len - used, &event);
+  } while (event != HTTP_FRAMER_EVENT_NONE &&
+	   event != HTTP_FRAMER_EVENT_HEADERS_END);
+  if (event != HTTP_FRAMER_EVENT_HEADERS_END)
+    return http_framer_lost(&framer) ? 0 : -1;
+
+  int operation = classify_ipp_operation((const char *)buf + used,
+					 len - used, framer.chunked);
+  if (operation < 0)
+    return -1;
+
+  switch (operation) {
+  case 0x0002: /* Print-Job */
+  case 0x0003: /* Print-URI */
+  case 0x0006: /* Send-Document */
+  case 0x0007: /* Send-URI */
+    break;
+  default:
+    *class = HTTP_CLASS_INTERACTIVE;
+  }
+  return 0;
+}
+
+const char *http_class_name(enum http_class class)
+{
+  switch (class) {
+  case HTTP_CLASS_INTERACTIVE:
+    return "interactive";
+  case HTTP_CLASS_BULK:
+    return "bulk";
+  default:
+    return "unknown";
+  }
+}
+
+enum http_exchange_state http_exchange_state(const struct http_framer *request,
+					     const struct http_framer *response)
+{
+  if (http_framer_lost(request) || http_framer_lost(response))
+    return HTTP_EXCHANGE_RESPONSE;
+  if (!http_framer_idle(response) || request->started != response->completed)
+    return HTTP_EXCHANGE_RESPONSE;
+  if (!http_framer_idle(request))
+    return HTTP_EXCHANGE_REQUEST;
+  return HTTP_EXCHANGE_IDLE;
+}
+
+uint32_t http_exchange_timeout(enum http_exchange_state state)
+{
+  switch (state) {
+  case HTTP_EXCHANGE_REQUEST:
+    return g_options.request_timeout;
+  case HTTP_EXCHANGE_RESPONSE:
+    return g_options.response_timeout;
+  default:
+    return g_options.keepalive_timeout;
+  }
+}
+
+const char *http_exchange_state_name(enum http_exchange_state state)
+{
+  switch (state) {
+  case HTTP_EXCHANGE_REQUEST:
+    return "in the middle of a request";
+  case HTTP_EXCHANGE_RESPONSE:
+    return "waiting for a response";
+  default:
+    return "between requests";
+  }
+}
@@ -24,3 +24,158 @@ struct http_packet_t {
 
 struct http_packet_t *packet_new();
 void packet_free(struct http_packet_t *pkt);
+
+/* Longest start or header line looked at by the framer. Longer lines are
+   truncated, which does not matter for the lines it cares about. */
+#define HTTP_LINE_MAX 256
+/* Longest method and request target kept from a request line, longer ones
+   are truncated */
+#define HTTP_METHOD_MAX 16
+#define HTTP_TARGET_MAX 128
+/* Bytes kept from the start of each body */
+#define HTTP_BODY_HEAD_MAX 8
+
+enum http_framer_state {
+  HTTP_FRAMER_START_LINE,
+  HTTP_FRAMER_HEADERS,
+  HTTP_FRAMER_BODY,
+  HTTP_FRAMER_CHUNK_SIZE,
+  HTTP_FRAMER_CHUNK_DATA,
+  HTTP_FRAMER_CHUNK_END,
+  HTTP_FRAMER_TRAILERS,
+  /* Response without length, it ends when the connection closes */
+  HTTP_FRAMER_UNTIL_CLOSE,
+  /* Not HTTP we understand, boundaries are unknown from here on */
+  HTTP_FRAMER_ERROR
+};
+
+/* What http_framer_next() stopped at */
+enum http_framer_event {
+  /* The data given has been used up */
+  HTTP_FRAMER_EVENT_NONE,
+  /* The start line of a message has been seen, its fields are filled in */
+  HTTP_FRAMER_EVENT_MESSAGE_BEGIN,
+  /* The header section has ended, the length of the body is known */
+  HTTP_FRAMER_EVENT_HEADERS_END,
+  /* The message, including its body and trailers, has ended */
+  HTTP_FRAMER_EVENT_MESSAGE_END
+};
+
+/* Follows the HTTP/1.1 messages in one direction of a connection as they
+   stream through, without copying or allocating, to tell where each message
+   ends. Interim (1xx) responses are not counted as messages. */
+struct http_framer {
+  int is_response;
+  enum http_framer_state state;
+  char line[HTTP_LINE_MAX];
+  size_t line_len;
+  size_t remaining;
+  int chunked;
+  int has_length;
+  int end_pending;
+
+  /* Start line of the current message: method and target of a request,
+     status of a response. Kept until the next one begins. */
+  char method[HTTP_METHOD_MAX];
+  char target[HTTP_TARGET_MAX];
+  int status;
+  /* 0 for HTTP/1.0, 1 for HTTP/1.1 */
+  int version_minor;
+  /* Whether the connection stays open after the current message, by its
+     version and Connection header */
+  int keep_alive;
+  /* Whether the current message carries IPP, and the first bytes of its
+     body, with chunked encoding removed */
+  int is_ipp;
+  uint8_t body_head[HTTP_BODY_HEAD_MAX];
+  size_t body_head_len;
+  /* Outstanding requests whose responses have no body (HEAD), one bit per
+     request, oldest in bit 0. Filled in by the request framer of the same
+     connection through |peer|, which makes this framer lose track once more
+     than 32 are outstanding. */
+  uint32_t no_body_mask;
+  uint32_t num_expected;
+  struct http_framer *peer;
+
+  uint32_t started;
+  uint32_t completed;
+  /* Bytes seen so far */
+  uint64_t bytes;
+};
+
+/* Prepares |framer| for a new connection. |peer| is the response framer when
+   |framer| follows the requests, NULL otherwise. */
+void http_framer_init(struct http_framer *framer, int is_response,
+		      struct http_framer *peer);
+
+/* Feeds the stream into |framer| up to the next message boundary within the
+   |len| bytes at |buf|. Returns the number of bytes used and tells in
+   |*event| what it stopped at, HTTP_FRAMER_EVENT_NONE once all of them are
+   used. Call again with the rest of the bytes, even if none are left, until
+   then. */
+size_t http_framer_next(struct http_framer *framer, const uint8_t *buf,
+			size_t len, enum http_framer_event *event);
+
+/* Feeds the next |len| bytes of the stream into |framer|. Returns the number
+   of messages which ended within them. */
+uint32_t http_framer_feed(struct http_framer *framer, const uint8_t *buf,
+			  size_t len);
+
+/* Returns non-zero once message boundaries can no longer be told, because
+   the stream is not understood or a response lasts until the connection
+   closes. */
+int http_framer_lost(const struct http_framer *framer);
+
+/* Returns non-zero if |framer| is between messages, with nothing of the next
+   one seen yet. */
+int http_framer_idle(const struct http_framer *framer);
+
+/* Returns the IPP operation-id of the current or last request, or the status
+   code of the current or last response, once enough of its body passed
+   through |framer|, and -1 before that or if the message is not IPP. */
+int http_framer_ipp_code(const struct http_framer *framer);
+
+/* What a connection is waiting for, which tells how long it may stay
+   silent. */
+enum http_exchange_state {
+  /* Between requests, kept alive for the next one */
+  HTTP_EXCHANGE_IDLE,
+  /* The client is in the middle of sending a request */
+  HTTP_EXCHANGE_REQUEST,
+  /* The printer has not answered every request yet */
+  HTTP_EXCHANGE_RESPONSE
+};
+
+/* Tells the state of the connection whose requests pass through |request|
+   and whose responses pass through |response|. Connections whose messages
+   cannot be followed count as waiting for a response. */
+enum http_exchange_state http_exchange_state(const struct http_framer *request,
+					     const struct http_framer *response);
+
+/* Seconds a connection in |state| may stay silent in both directions before
+   it is closed, as configured in g_options. */
+uint32_t http_exchange_timeout(enum http_exchange_state state);
+
+const char *http_exchange_state_name(enum http_exchange_state state);
+
+/* Traffic classes. Interactive requests are short queries like the
+   Get-Printer-Attributes and Get-Jobs polls of CUPS or the ScannerStatus
+   queries of eSCL clients, bulk requests carry or fetch documents and may
+   hold an interface for minutes. */
+enum http_class {
+  HTTP_CLASS_INTERACTIVE,
+  HTTP_CLASS_BULK,
+  HTTP_CLASS_COUNT
+};
+
+/* Bytes at the start of a request which http_classify() looks at */
+#define HTTP_CLASSIFY_MAX 1024
+
+/* Tells the class of the request starting at |buf| by its method and path
+   and, for IPP, by its operation. Returns 0 once |*class| is known, and -1
+   if the |len| bytes seen so far are not enough to tell, in which case
+   |*class| holds the best guess. */
+int http_classify(const uint8_t *buf, size_t len, enum http_class *class);
+
+const char *http_class_name(enum http_class class);
+
@@ -21,13 +21,19 @@
 #include <libusb.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "cache.h"
 #include "dnssd.h"
+#include "event.h"
 #include "http.h"
 #include "logging.h"
 #include "options.h"
@@ -35,10 +41,33 @@
 #include "usb.h"
 
 /* Global variables */
-static pthread_mutex_t thread_register_mutex;
-static struct service_thread_param **service_threads = NULL;
+/* Registry of the threads currently serving a connection, an intrusive
+   doubly-linked list through their parameters. */
+static pthread_mutex_t thread_register_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct service_thread_param *service_threads = NULL;
 static uint32_t num_service_threads = 0;
 
+/* Worker pool, see struct service_worker */
+static pthread_mutex_t worker_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_pool_cond = PTHREAD_COND_INITIALIZER;
+static struct service_worker *workers = NULL;
+static uint32_t num_workers = 0;
+static struct service_worker *free_workers = NULL;
+/* Default size of the pool. Idle keep-alive connections hold their worker
+   as well, so it is well above the number of interfaces. */
+#define WORKERS_PER_INTERFACE 8
+#define WORKERS_MIN 16
+
+/* Connections which went silent for longer than |legacy_idle_timeout| and
+   were then used again */
+static uint32_t reconnects_avoided = 0;
+
+/* The listening sockets of the threaded mode */
+static struct tcp_listener listener = { .epfd = -1 };
+
+/* First file descriptor passed by systemd socket activation */
+#define LISTEN_FDS_START 3
+
 static void sigterm_handler(int sig)
 {
   /* Flag that we should stop and return... */
@@ -46,150 +75,218 @@ static void sigterm_handler(int sig)
   NOTE("Caught signal %d, shutting down ...", sig);
 }
 
-static void list_service_threads(
-    uint32_t num_service_threads,
-    struct service_thread_param **service_threads)
+static void register_thread(struct service_thread_param *param)
 {
-  uint32_t i;
-  char *p;
-  char buf[10240];
-  size_t written = 0;
-
-  /* Set all bytes in |buf| to the null terminator so that we don't have to
-     worry about it later. */
-  memset(buf, '\0', sizeof(buf));
-
-  written += snprintf(buf, sizeof(buf), "Threads currently running: ");
-  p = buf + written;
-
-  if (num_service_threads == 0) {
-    written += snprintf(p, sizeof(buf) - written, "None");
-  } else {
-    for (i = 0; i < num_service_threads; i++) {
-      written += snprintf(p, sizeof(buf) - written, "#%u",
-                          service_threads[i]->thread_num);
-      p = buf + written;
-      if (i + 1 < num_service_threads) {
-        written += snprintf(p, sizeof(buf) - written, ", ");
-        p = buf + written;
-      }
-    }
+  uint32_t count;
+
+  pthread_mutex_lock(&thread_register_mutex);
+  if (!param->registered) {
+    param->prev = NULL;
+    param->next = service_threads;
+    if (service_threads != NULL)
+      service_threads->prev = param;
+    service_threads = param;
+    param->registered = 1;
+    num_service_threads++;
   }
-  NOTE("%s", buf);
+  count = num_service_threads;
+  pthread_mutex_unlock(&thread_register_mutex);
+
+  NOTE("Registered thread #%u, %u threads currently running",
+       param->thread_num, count);
 }
 
-static int register_service_thread(
-    uint32_t *num_service_threads,
-    struct service_thread_param ***service_threads,
-    struct service_thread_param *new_thread)
+static void unregister_thread(struct service_thread_param *param)
 {
-  NOTE("Registering thread #%u", new_thread->thread_num);
-  (*num_service_threads)++;
-  *service_threads =
-      realloc(*service_threads, *num_service_threads * sizeof(void *));
-  if (*service_threads == NULL) {
-    ERR("Registering thread #%u: Failed to alloc space for thread registration "
-        "list",
-        new_thread->thread_num);
-    return -1;
+  uint32_t count;
+
+  pthread_mutex_lock(&thread_register_mutex);
+  if (param->registered) {
+    if (param->prev != NULL)
+      param->prev->next = param->next;
+    else
+      service_threads = param->next;
+    if (param->next != NULL)
+      param->next->prev = param->prev;
+    param->prev = NULL;
+    param->next = NULL;
+    param->registered = 0;
+    num_service_threads--;
   }
-  (*service_threads)[*num_service_threads - 1] = new_thread;
-  return 0;
+  count = num_service_threads;
+  pthread_mutex_unlock(&thread_register_mutex);
+
+  NOTE("Unregistered thread #%u, %u threads currently running",
+       param->thread_num, count);
 }
 
-static int unregister_service_thread(
-    uint32_t *num_service_threads,
-    struct service_thread_param ***service_threads, uint32_t thread_num)
+uint32_t for_each_service_thread(
+    void (*callback)(struct service_thread_param *, void *), void *data)
 {
-  uint32_t i;
+  uint32_t count = 0;
 
-  NOTE("Unregistering thread #%u", thread_num);
-  /* Search |service_threads| for an element with a matching thread number. */
-  for (i = 0; i < *num_service_threads; i++) {
-    if ((*service_threads)[i]->thread_num == thread_num) break;
+  pthread_mutex_lock(&thread_register_mutex);
+  for (struct service_thread_param *param = service_threads; param != NULL;
+       param = param->next) {
+    if (callback != NULL)
+      callback(param, data);
+    count++;
   }
+  pthread_mutex_unlock(&thread_register_mutex);
 
-  if (i >= *num_service_threads) {
-    ERR("Unregistering thread #%u: Cannot unregister, not found", thread_num);
-    return -1;
-  }
+  return count;
+}
 
-  (*num_service_threads)--;
-  struct service_thread_param *removed_thread = (*service_threads)[i];
-  /* Shift the contents after |removed_thread| down. */
-  for (; i < *num_service_threads; i++) {
-    (*service_threads)[i] = (*service_threads)[i + 1];
-  }
-  free(removed_thread);
+static void note_service_thread(struct service_thread_param *param,
+                                void *data)
+{
+  (void)data;
+  NOTE("Thread #%u is still running", param->thread_num);
+}
 
-  *service_threads =
-      realloc(*service_threads, *num_service_threads * sizeof(void *));
+static void
+cleanup_handler(void *arg_void)
+{
+  struct service_thread_param *param = arg_void;
+  if (!param->registered)
+    return;
+  NOTE("Thread #%u: Called clean-up handler", param->thread_num);
+  unregister_thread(param);
+}
 
-  if (*num_service_threads == 0) {
-    *service_threads = NULL;
-  } else if (*service_threads == NULL) {
-    ERR("Unregistering thread #%u: Failed to alloc space for thread "
-        "registration list",
-        thread_num);
-    return -1;
-  }
+/* Follows the response data in |pkt|, so that the printer thread stops reading
+   once the responses to all requests so far are complete. */
+static void note_response_data(struct libusb_callback_data *user_data,
+                               struct http_packet_t *pkt)
+{
+  pthread_mutex_lock(user_data->read_inflight_mutex);
+  cache_fill_feed(user_data->cache_fill, pkt->buffer, pkt->filled_size);
+  if (http_framer_feed(user_data->response_framer, pkt->buffer,
+                       pkt->filled_size))
+    pthread_cond_broadcast(user_data->read_inflight_cond);
+  pthread_mutex_unlock(user_data->read_inflight_mutex);
+}
 
-  return 0;
+/* Follows the request data in |buf| through the request framer of |worker|,
+   noting every request as it begins and telling the attribute cache about
+   its operation. Returns the number of requests which ended within it. Must
+   be called with the read_mutex of |worker| held. */
+static uint32_t frame_requests(struct service_worker *worker,
+                               uint32_t thread_num, const uint8_t *buf,
+                               size_t len)
+{
+  struct http_framer *framer = &worker->request_framer;
+  enum http_framer_event event;
+  uint32_t ended = 0;
+  size_t used = 0;
+
+  do {
+    used += http_framer_next(framer, buf + used, len - used, &event);
+    if (event == HTTP_FRAMER_EVENT_MESSAGE_BEGIN) {
+      NOTE("Thread #%u: Request #%u: %s %s HTTP/1.%d", thread_num,
+           framer->started, framer->method, framer->target,
+           framer->version_minor);
+      worker->operation_noted = 0;
+    } else if (event == HTTP_FRAMER_EVENT_MESSAGE_END) {
+      ended++;
+    }
+    if (g_options.attr_cache_ttl && !worker->operation_noted &&
+        http_framer_ipp_code(framer) >= 0) {
+      cache_note_operation(http_framer_ipp_code(framer));
+      worker->operation_noted = 1;
+    }
+  } while (event != HTTP_FRAMER_EVENT_NONE);
+
+  return ended;
 }
 
-static void
-cleanup_handler(void *arg_void)
+/* Returns non-zero while the client of |worker| waits for (the rest of) a
+   response, or when we cannot tell. Must be called with the read_mutex of
+   |worker| held. */
+static int response_pending(struct service_worker *worker)
 {
-  uint32_t thread_num = *((int *)(arg_void));
-  NOTE("Thread #%u: Called clean-up handler", thread_num);
-  pthread_mutex_lock(&thread_register_mutex);
-  unregister_service_thread(&num_service_threads, &service_threads, thread_num);
-  list_service_threads(num_service_threads, service_threads);
-  pthread_mutex_unlock(&thread_register_mutex);
+  return http_framer_lost(&worker->request_framer) ||
+    http_framer_lost(&worker->response_framer) ||
+    worker->request_framer.started > worker->response_framer.completed;
+}
+
+/* Records data passing through the connection |tcp| of thread |thread_num|
+   and counts it as a reconnect avoided if the connection would have been
+   closed before for the silence that came before. */
+static void note_activity(struct tcp_conn_t *tcp, uint32_t thread_num)
+{
+  time_t silence = tcp_conn_touch(tcp);
+  if (silence >= legacy_idle_timeout) {
+    uint32_t count = __atomic_add_fetch(&reconnects_avoided, 1,
+                                        __ATOMIC_RELAXED);
+    NOTE("Thread #%u: Used again after %ld s of silence, %u reconnects "
+         "avoided so far", thread_num, (long)silence, count);
+  }
+}
+
+/* Gives up on the interface of |conn| after a transfer failed in a way which
+   leaves its state unknown. The client connection is ended, since responses
+   may have been lost, and usb_conn_unbind() quarantines the interface until
+   it has been reset. */
+static void abandon_interface(struct usb_conn_t *conn,
+                              struct libusb_callback_data *user_data)
+{
+  conn->is_staled = 1;
+  shutdown(user_data->tcp->sd, SHUT_RDWR);
 }
 
-static void read_transfer_callback(struct libusb_transfer *transfer)
+static void read_transfer_callback(struct usb_conn_t *conn,
+                                   struct http_packet_t *pkt,
+                                   enum libusb_transfer_status status,
+                                   void *user_data_void)
 {
   struct libusb_callback_data *user_data =
-      (struct libusb_callback_data *)transfer->user_data;
+      (struct libusb_callback_data *)user_data_void;
 
   uint32_t thread_num = user_data->thread_num;
-  pthread_mutex_t *read_inflight_mutex = user_data->read_inflight_mutex;
-  pthread_cond_t *read_inflight_cond = user_data->read_inflight_cond;
+  (void)conn;
 
-  switch (transfer->status) {
+  switch (status) {
     case LIBUSB_TRANSFER_COMPLETED:
-      user_data->pkt->filled_size = transfer->actual_length;
-
-      if (transfer->actual_length) {
+      if (pkt->filled_size) {
         NOTE("Thread #%u: Pkt from %s (buffer size: %zu)\n===\n%s===",
-             thread_num, "usb", user_data->pkt->filled_size,
-             hexdump(user_data->pkt->buffer, (int)user_data->pkt->filled_size));
-        tcp_packet_send(user_data->tcp, user_data->pkt);
-        /* Mark the tcp socket as active. */
-        set_is_active(user_data->tcp, 1);
+             thread_num, "usb", pkt->filled_size,
+             hexdump(pkt->buffer, (int)pkt->filled_size));
+        note_response_data(user_data, pkt);
+        tcp_packet_send(user_data->tcp, pkt);
+        user_data->bytes_received += pkt->filled_size;
+        note_activity(user_data->tcp, thread_num);
       } else {
         /* Set that we received an empty response from the printer. */
-        *user_data->empty_response = 1;
+        pthread_mutex_lock(user_data->read_inflight_mutex);
+        user_data->empty_response = 1;
+        pthread_mutex_unlock(user_data->read_inflight_mutex);
       }
 
       break;
     case LIBUSB_TRANSFER_ERROR:
       ERR("Thread #%u: There was an error completing the transfer", thread_num);
-      g_options.terminate = 1;
+      abandon_interface(conn, user_data);
       break;
     case LIBUSB_TRANSFER_TIMED_OUT:
       NOTE(
           "Thread #%u: The transfer timed out before it could be completed: "
-          "Received %u bytes",
-          thread_num, transfer->actual_length);
+          "Received %zu bytes",
+          thread_num, pkt->filled_size);
+      /* Do not lose what arrived before the timeout. */
+      if (pkt->filled_size) {
+        note_response_data(user_data, pkt);
+        tcp_packet_send(user_data->tcp, pkt);
+        user_data->bytes_received += pkt->filled_size;
+        note_activity(user_data->tcp, thread_num);
+      }
       break;
     case LIBUSB_TRANSFER_CANCELLED:
       NOTE("Thread #%u: The transfer was cancelled", thread_num);
       break;
     case LIBUSB_TRANSFER_STALL:
       ERR("Thread #%u: The transfer has stalled", thread_num);
-      g_options.terminate = 1;
+      abandon_interface(conn, user_data);
       break;
     case LIBUSB_TRANSFER_NO_DEVICE:
       ERR("Thread #%u: The printer was disconnected during the transfer",
@@ -199,94 +296,373 @@ static void read_transfer_callback(struct libusb_transfer *transfer)
     case LIBUSB_TRANSFER_OVERFLOW:
       ERR("Thread #%u: The printer sent more data than was requested",
           thread_num);
-      g_options.terminate = 1;
+      abandon_interface(conn, user_data);
       break;
     default:
       ERR("Thread #%u: Something unexpected happened", thread_num);
-      g_options.terminate = 1;
+      abandon_interface(conn, user_data);
   }
+}
 
-  /* Free the packet used for the transfer. */
-  packet_free(user_data->pkt);
+/* Puts |worker| back into the pool once it is done with its connection. */
+static void release_worker(struct service_worker *worker)
+{
+  pthread_mutex_lock(&worker->mutex);
+  worker->state = WORKER_IDLE;
+  pthread_mutex_unlock(&worker->mutex);
+
+  pthread_mutex_lock(&worker_pool_mutex);
+  worker->next_free = free_workers;
+  free_workers = worker;
+  pthread_cond_signal(&worker_pool_cond);
+  pthread_mutex_unlock(&worker_pool_mutex);
+}
 
-  /* Mark the transfer as completed. */
-  pthread_mutex_lock(read_inflight_mutex);
-  *user_data->read_inflight = 0;
-  pthread_cond_broadcast(read_inflight_cond);
-  pthread_mutex_unlock(read_inflight_mutex);
+/* Takes an idle worker from the pool, waiting for one to become idle if all of
+   them are busy. Returns NULL if the daemon is shutting down. */
+static struct service_worker *acquire_worker(void)
+{
+  struct service_worker *worker = NULL;
+
+  pthread_mutex_lock(&worker_pool_mutex);
+  int busy = free_workers == NULL && !g_options.terminate;
+  struct timespec busy_since;
+  if (busy) {
+    NOTE("All %u workers busy, new connections wait in the listen queue",
+         num_workers);
+    clock_gettime(CLOCK_MONOTONIC, &busy_since);
+  }
+  while (free_workers == NULL && !g_options.terminate) {
+    /* Wake up regularly as the termination flag is set from a signal
+       handler which cannot signal the condition. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&worker_pool_cond, &worker_pool_mutex, &deadline);
+  }
+  if (busy && !g_options.terminate) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    NOTE("A worker became free after %ld ms",
+         (long)(now.tv_sec - busy_since.tv_sec) * 1000 +
+             (now.tv_nsec - busy_since.tv_nsec) / 1000000);
+  }
+  if (!g_options.terminate) {
+    worker = free_workers;
+    free_workers = worker->next_free;
+    worker->next_free = NULL;
+  }
+  pthread_mutex_unlock(&worker_pool_mutex);
 
-  /* Cleanup the data used for the transfer */
-  free(user_data);
-  libusb_free_transfer(transfer);
+  return worker;
 }
 
-void *service_connection(void *params_void)
+/* Hands the data collected in |*batch| to the printer. */
+static int flush_to_printer(struct service_thread_param *params,
+                            struct http_packet_t **batch)
 {
-  struct service_thread_param *params =
-      (struct service_thread_param *)params_void;
-  uint32_t thread_num = params->thread_num;
+  *batch = NULL;
+  if (usb_conn_write_queue_submit(params->usb_conn)) {
+    NOTE("Thread #%u: The printer stopped taking data", params->thread_num);
+    return -1;
+  }
+  return 0;
+}
 
-  /* Detach this thread so that the main thread does not need to join this
-     thread after termination for clean-up. */
-  pthread_detach(pthread_self());
+/* Returns non-zero once the client has no request underway and the responses
+   to all of its requests have been forwarded, so that the interface of its
+   connection may serve another one. Must be called with the read_mutex of
+   |worker| held. */
+static int exchange_done(struct service_worker *worker)
+{
+  return http_framer_idle(&worker->request_framer) &&
+    http_framer_idle(&worker->response_framer) &&
+    worker->request_framer.started == worker->response_framer.completed;
+}
 
-  /* Register clean-up handler. */
-  pthread_cleanup_push(cleanup_handler, &thread_num);
+/* Waits for the client of |params| to send more than the |have| bytes it
+   has sent so far, for what remains of the |classify_delay| milliseconds
+   since |start|. Returns non-zero if it may have, so that the request is to
+   be peeked at again, and 0 if the time is up. */
+static int classify_wait(struct service_thread_param *params,
+                         const struct timespec *start, ssize_t have)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long left = classify_delay - ((now.tv_sec - start->tv_sec) * 1000 +
+                                (now.tv_nsec - start->tv_nsec) / 1000000);
+  if (left <= 0)
+    return 0;
+  return tcp_conn_wait_more(params->tcp, have > 0 ? (size_t)have : 0,
+                            (int)left) > 0;
+}
 
-  /* Allow immediate cancelling of this thread. */
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+/* Tells the traffic class of the request the client of |params| has started
+   to send, waiting up to |classify_delay| milliseconds for enough of it to
+   arrive. Returns -1 if the client closed the connection instead. */
+static int classify_request(struct service_thread_param *params,
+                            enum http_class *traffic_class)
+{
+  uint8_t start[HTTP_CLASSIFY_MAX];
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
 
-  /* Attempt to establish a connection with the printer. */
-  if (setup_usb_connection(params->usb_sock, params))
-    goto cleanup;
+  for (;;) {
+    ssize_t len = tcp_conn_peek(params->tcp, start, sizeof(start));
+    if (len == 0 || params->tcp->is_closed)
+      return -1;
+    if (len > 0 &&
+        (http_classify(start, (size_t)len, traffic_class) == 0 ||
+         (size_t)len == sizeof(start)))
+      break;
+    if (!classify_wait(params, &begin, len))
+      break;
+  }
 
-  /* Condition variable used to broadcast updates to the printer thread. */
-  pthread_cond_t cond;
-  if (pthread_cond_init(&cond, NULL))
-    goto cleanup;
-  params->cond = &cond;
+  NOTE("Thread #%u: %s request", params->thread_num,
+       http_class_name(*traffic_class));
+  return 0;
+}
 
-  /* Copy the contents of |params| into |printer_params|. The only
-     differences between the two are the |thread_num| and |thread_handle|. */
-  struct service_thread_param *printer_params =
-      calloc(1, sizeof(*printer_params));
-  memcpy(printer_params, params, sizeof(*printer_params));
-  printer_params->thread_num += 1;
+/* Answers the Get-Printer-Attributes request the client of |params| has
+   started to send from the attribute cache, waiting up to |classify_delay|
+   milliseconds for all of it to arrive. Otherwise the response the printer
+   gives to it is collected for the cache. Returns 1 if the request was
+   answered, 0 if it has to go to the printer and -1 if the connection is to
+   be closed. */
+static int serve_from_cache(struct service_thread_param *params)
+{
+  struct service_worker *worker = params->worker;
+  uint8_t buf[CACHE_REQUEST_MAX];
+  struct cache_query query;
+  int status = -1;
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
 
-  /* Attempt to start the printer's end of the communication. */
-  if (setup_communication_thread(&service_printer_connection, printer_params))
-    goto cleanup;
+  for (;;) {
+    ssize_t len = tcp_conn_peek(params->tcp, buf, sizeof(buf));
+    if (len == 0 || params->tcp->is_closed)
+      return -1;
+    if (len > 0)
+      status = cache_parse_request(buf, (size_t)len, &query);
+    if (status >= 0 || (size_t)len == sizeof(buf) ||
+        !classify_wait(params, &begin, len))
+      break;
+  }
+  if (status <= 0)
+    return 0;
 
-  pthread_t printer_params_thread_handle = printer_params->thread_handle;
+  struct http_packet_t *pkt = cache_lookup(&query);
+  if (pkt == NULL) {
+    /* No response is on its way, so the next one is the one to this
+       request. */
+    pthread_mutex_lock(&worker->read_mutex);
+    cache_fill_begin(&worker->cache_fill, &query);
+    pthread_mutex_unlock(&worker->read_mutex);
+    return 0;
+  }
+
+  /* The request is done with here, the printer never sees it. */
+  int result = 1;
+  if (tcp_conn_skip(params->tcp, query.length) ||
+      tcp_packet_send(params->tcp, pkt) || params->tcp->is_closed)
+    result = -1;
+  else if (!query.keep_alive) {
+    NOTE("Thread #%u: Client asked to close the connection",
+         params->thread_num);
+    result = -1;
+  }
+  packet_free(pkt);
+  note_activity(params->tcp, params->thread_num);
+  return result;
+}
+
+/* Takes an interface for the request of |traffic_class| the client of
+   |params| has started to send and hands it to the printer thread as well.
+   Returns 0 on success and a non-zero value if no interface could be had. */
+static int acquire_lease(struct service_thread_param *params,
+                         enum http_class traffic_class)
+{
+  struct service_worker *worker = params->worker;
+
+  if (usb_conn_bind(worker->usb_conn, traffic_class)) {
+    ERR("Thread #%u: Failed to acquire usb interface", params->thread_num);
+    return -1;
+  }
+  if (usb_conn_write_queue_init(worker->usb_conn,
+                                g_options.write_queue_depth)) {
+    usb_conn_unbind(worker->usb_conn);
+    return -1;
+  }
+  params->usb_conn = worker->usb_conn;
+  NOTE("Thread #%u: interface #%u: acquired usb conn", params->thread_num,
+       params->usb_conn->interface_index);
+
+  clock_gettime(CLOCK_MONOTONIC, &worker->lease_start);
+  worker->client_reads = 0;
+  worker->client_polls = 0;
+
+  pthread_mutex_lock(&worker->read_mutex);
+  worker->lease = params->usb_conn;
+  pthread_cond_broadcast(params->cond);
+  pthread_mutex_unlock(&worker->read_mutex);
+  return 0;
+}
+
+/* Gives the interface of the connection of |params| back to the pool, once
+   everything the client sent has reached the printer and the printer thread
+   has stopped reading from it. */
+static void release_lease(struct service_thread_param *params)
+{
+  struct service_worker *worker = params->worker;
+  struct usb_conn_t *usb_conn = params->usb_conn;
+  uint32_t thread_num = params->thread_num;
+
+  if (!g_options.terminate && usb_conn_write_queue_flush(usb_conn))
+    NOTE("Thread #%u: Not all data reached the printer", thread_num);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (double)(end.tv_sec - worker->lease_start.tv_sec) +
+                   (double)(end.tv_nsec - worker->lease_start.tv_nsec) / 1e9;
+  double megabytes = (double)usb_conn->bytes_written / 1e6;
+  NOTE("Thread #%u: Sent %zu bytes to the printer in %.3f s "
+       "(%.2f MB/s, write queue depth %u), printer stalled %u times "
+       "for %.3f s", thread_num, usb_conn->bytes_written, seconds,
+       seconds > 0 ? megabytes / seconds : 0.0, g_options.write_queue_depth,
+       usb_conn->write_stalls, (double)usb_conn->write_stall_time / 1e6);
+  NOTE("Thread #%u: %u reads from the client coalesced into %u USB writes "
+       "(%.1f per MB)", thread_num, worker->client_reads,
+       usb_conn->writes_submitted,
+       megabytes > 0 ? usb_conn->writes_submitted / megabytes : 0.0);
+  NOTE("Thread #%u: %u polls and %u reads of the client socket "
+       "(%.1f system calls per MB)", thread_num, worker->client_polls,
+       worker->client_reads,
+       megabytes > 0 ? (worker->client_polls + worker->client_reads) /
+                       megabytes : 0.0);
+  NOTE("Thread #%u: At most %zu bytes were on their way to the printer",
+       thread_num, usb_conn->bytes_inflight_peak);
+  NOTE("Thread #%u: Framed %u requests in %llu bytes and %u responses in "
+       "%llu bytes so far", thread_num, worker->request_framer.completed,
+       (unsigned long long)worker->request_framer.bytes,
+       worker->response_framer.completed,
+       (unsigned long long)worker->response_framer.bytes);
+
+  /* Take the interface away from the printer thread, which cancels its reads
+     and lets go of it. */
+  pthread_mutex_lock(&worker->read_mutex);
+  worker->lease = NULL;
+  pthread_cond_broadcast(params->cond);
+  while (worker->printer_lease != NULL)
+    pthread_cond_wait(params->cond, &worker->read_mutex);
+  pthread_mutex_unlock(&worker->read_mutex);
+
+  /* The transfers and buffers stay with the worker for its next lease. */
+  usb_conn_write_queue_cancel(usb_conn);
+  struct usb_sock_t *usb = usb_conn->parent;
+  sem_wait(&usb->buffered_lock);
+  NOTE("Thread #%u: All connections hold %zu bytes, at most %zu so far",
+       thread_num, usb->buffered, usb->buffered_peak);
+  sem_post(&usb->buffered_lock);
+
+  NOTE("Thread #%u: interface #%u: releasing usb conn", thread_num,
+       usb_conn->interface_index);
+  usb_conn_unbind(usb_conn);
+  params->usb_conn = NULL;
+  usb_recover_interfaces(usb);
+}
+
+static void serve_connection(struct service_worker *worker)
+{
+  struct service_thread_param *params = &worker->socket_param;
+  uint32_t thread_num = params->thread_num;
+
+  register_thread(params);
+
+  pthread_mutex_lock(&worker->read_mutex);
+  http_framer_init(&worker->response_framer, 1, NULL);
+  http_framer_init(&worker->request_framer, 0, &worker->response_framer);
+  worker->lease = NULL;
+  worker->printer_lease = NULL;
+  pthread_mutex_unlock(&worker->read_mutex);
+
+  /* Start the printer's end of the communication. The only differences
+     between the parameters of the two threads are the |thread_num| and
+     |thread_handle|. */
+  pthread_mutex_lock(&worker->mutex);
+  worker->printer_param.thread_num = thread_num + 1;
+  worker->printer_busy = 1;
+  pthread_cond_broadcast(&worker->wakeup);
+  pthread_mutex_unlock(&worker->mutex);
 
   /* This function will run until the socket has been closed. When this function
      returns it means that the communication has been completed. */
   service_socket_connection(params);
+  params->tcp->is_closed = 1;
+
+  /* What the client sent before closing still goes to the printer. */
+  if (params->usb_conn != NULL)
+    release_lease(params);
 
   /* Notify the printer's end that the socket has closed so that it does not
      have to wait for any pending asynchronous transfers to complete. */
+  pthread_mutex_lock(&worker->read_mutex);
   pthread_cond_broadcast(params->cond);
-  
-  /* Wait for the printer thread to exit. */
+  pthread_mutex_unlock(&worker->read_mutex);
+
+  /* Wait for the printer thread to be done with the connection. */
   NOTE("Thread #%u: Waiting for thread #%u to complete", thread_num,
        thread_num + 1);
-  if (pthread_join(printer_params_thread_handle, NULL))
-    ERR("Thread #%u: Something went wrong trying to join the printer thread",
-        thread_num);
-
-cleanup:
-  if (params->usb_conn != NULL) {
-    NOTE("Thread #%u: interface #%u: releasing usb conn", thread_num,
-         params->usb_conn->interface_index);
-    usb_conn_release(params->usb_conn);
-    params->usb_conn = NULL;
-  }
+  pthread_mutex_lock(&worker->mutex);
+  while (worker->printer_busy)
+    pthread_cond_wait(&worker->wakeup, &worker->mutex);
+  pthread_mutex_unlock(&worker->mutex);
+
+  /* A response which did not arrive in full is not kept. */
+  pthread_mutex_lock(&worker->read_mutex);
+  cache_fill_abort(&worker->cache_fill);
+  pthread_mutex_unlock(&worker->read_mutex);
 
   NOTE("Thread #%u: closing, %s", thread_num,
        g_options.terminate ? "shutdown requested"
                            : "communication thread terminated");
-  tcp_conn_close(params->tcp);
+  /* Under the worker's lock, as stop_workers() may shut the socket down. */
+  pthread_mutex_lock(&worker->mutex);
+  tcp_conn_shutdown(params->tcp);
+  pthread_mutex_unlock(&worker->mutex);
+
+  unregister_thread(params);
+}
+
+void *service_connection(void *worker_void)
+{
+  struct service_worker *worker = (struct service_worker *)worker_void;
+
+  /* Register clean-up handler. */
+  pthread_cleanup_push(cleanup_handler, &worker->socket_param);
+
+  /* Allow immediate cancelling of this thread. */
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  for (;;) {
+    pthread_mutex_lock(&worker->mutex);
+    while (worker->state != WORKER_ASSIGNED && !g_options.terminate)
+      pthread_cond_wait(&worker->wakeup, &worker->mutex);
+    int assigned = worker->state == WORKER_ASSIGNED;
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (!assigned)
+      break;
+
+    serve_connection(worker);
+    release_worker(worker);
+  }
+
+  /* Let the printer thread know that there is no more work coming. */
+  pthread_mutex_lock(&worker->mutex);
+  pthread_cond_broadcast(&worker->wakeup);
+  pthread_mutex_unlock(&worker->mutex);
 
   /* Execute clean-up handler. */
   pthread_cleanup_pop(1);
@@ -296,153 +672,384 @@ cleanup:
 void service_socket_connection(struct service_thread_param *params)
 {
   uint32_t thread_num = params->thread_num;
+  struct service_worker *worker = params->worker;
+
+  /* Data from the client is received straight into the buffer of the next
+     USB write, until it holds a whole number of max packets of the OUT
+     endpoint, a message has ended or nothing more arrived for
+     |coalesce_delay| milliseconds, and then written to the printer in one
+     transfer. */
+  struct http_packet_t *batch = NULL;
+  size_t limit = 0;
+  struct timespec deadline;
+  /* Set while the last read took all the space offered, the socket is read
+     again right away as more is likely waiting. Otherwise readiness is
+     waited for first. */
+  int readable = 0;
 
   while (is_socket_open(params) && !g_options.terminate) {
-    int result = poll_tcp_socket(params->tcp);
+    /* When sharing interfaces, give ours back as soon as the client has
+       got all its responses, and take one again with its next request. */
+    if (g_options.multiplex_mode && params->usb_conn != NULL &&
+        (batch == NULL || batch->filled_size == 0)) {
+      pthread_mutex_lock(&worker->read_mutex);
+      int done = exchange_done(worker);
+      pthread_mutex_unlock(&worker->read_mutex);
+      if (done) {
+        batch = NULL;
+        release_lease(params);
+      }
+    }
+
+    int result;
+    if (readable && params->usb_conn != NULL) {
+      result = 1;
+    } else if (batch == NULL || batch->filled_size == 0) {
+      /* How long the connection may stay silent depends on what it is
+         waiting for, which may change while it waits. */
+      pthread_mutex_lock(&worker->read_mutex);
+      enum http_exchange_state state =
+          http_exchange_state(&worker->request_framer,
+                              &worker->response_framer);
+      pthread_mutex_unlock(&worker->read_mutex);
+      time_t timeout = (time_t)http_exchange_timeout(state);
+      time_t idle = tcp_conn_idle_time(params->tcp);
+      if (idle >= timeout) {
+        NOTE("Thread #%u: Silent for %ld s %s, closing", thread_num,
+             (long)idle, http_exchange_state_name(state));
+        break;
+      }
+      worker->client_polls++;
+      result = poll_tcp_socket_wake(params->tcp, worker->wake_fd, 1000);
+    } else {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long wait = (long)(deadline.tv_sec - now.tv_sec) * 1000 +
+                  (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      if (wait > 0)
+        worker->client_polls++;
+      result = wait > 0 ? tcp_conn_poll(params->tcp, (int)wait) : 0;
+      if (result == 0) {
+        if (flush_to_printer(params, &batch))
+          break;
+        continue;
+      }
+    }
     if (result < 0 || !is_socket_open(params)) {
       NOTE("Thread #%u: Client closed connection", thread_num);
-      return;
+      break;
     } else if (result == 0) {
       continue;
     }
 
-    struct http_packet_t *pkt = tcp_packet_get(params->tcp);
-    if (pkt == NULL) {
-      NOTE("Thread #%u: There was an error reading from the socket",
-           thread_num);
-      return;
+    /* A connection which keeps its interface between requests asks the
+       cache as well, for every request which starts once all earlier ones
+       got their responses, so that no response is on its way to the client
+       while the cache writes to it. */
+    if (params->usb_conn != NULL && g_options.attr_cache_ttl &&
+        (batch == NULL || batch->filled_size == 0)) {
+      pthread_mutex_lock(&worker->read_mutex);
+      int boundary = exchange_done(worker);
+      pthread_mutex_unlock(&worker->read_mutex);
+      enum http_class traffic_class = HTTP_CLASS_BULK;
+      if (boundary && classify_request(params, &traffic_class)) {
+        NOTE("Thread #%u: Client closed connection", thread_num);
+        break;
+      }
+      if (boundary && traffic_class == HTTP_CLASS_INTERACTIVE) {
+        int answered = serve_from_cache(params);
+        if (answered < 0) {
+          NOTE("Thread #%u: Client closed connection", thread_num);
+          break;
+        }
+        if (answered) {
+          readable = 0;
+          continue;
+        }
+      }
     }
 
-    if (!is_socket_open(params)) {
-      NOTE("Thread #%u: Client closed connection", thread_num);
-      return;
+    /* The first bytes of a request tell which interfaces it may take.
+       Unless interfaces are shared, the connection keeps the one it got for
+       its first request until it closes. */
+    if (params->usb_conn == NULL) {
+      enum http_class traffic_class;
+      if (classify_request(params, &traffic_class)) {
+        NOTE("Thread #%u: Client closed connection", thread_num);
+        break;
+      }
+      if (g_options.attr_cache_ttl &&
+          traffic_class == HTTP_CLASS_INTERACTIVE) {
+        int answered = serve_from_cache(params);
+        if (answered < 0) {
+          NOTE("Thread #%u: Client closed connection", thread_num);
+          break;
+        }
+        if (answered)
+          continue;
+      }
+      if (acquire_lease(params, traffic_class)) {
+        NOTE("Thread #%u: No interface for the request", thread_num);
+        break;
+      }
+    }
+    if (batch == NULL) {
+      /* Waits while all writes are in flight, so that a slow printer
+         holds the client back. */
+      batch = usb_conn_write_queue_get(params->usb_conn);
+      if (batch == NULL) {
+        NOTE("Thread #%u: The printer stopped taking data", thread_num);
+        break;
+      }
+      uint16_t max_packet = params->usb_conn->interface->max_packet_out;
+      limit = batch->buffer_capacity;
+      if (max_packet > 0 && limit > max_packet)
+        limit -= limit % max_packet;
     }
 
-    NOTE("Thread #%u: Pkt from tcp (buffer size: %zu)\n===\n%s===", thread_num,
-         pkt->filled_size, hexdump(pkt->buffer, (int)pkt->filled_size));
+    size_t offset = batch->filled_size;
+    ssize_t gotten_size = tcp_packet_append(params->tcp, batch, limit);
+    worker->client_reads++;
+    readable = gotten_size > 0 && (size_t)gotten_size == limit - offset;
+    if (gotten_size < 0 && !params->tcp->is_closed)
+      continue;
+    if (gotten_size <= 0) {
+      NOTE("Thread #%u: Client closed connection", thread_num);
+      break;
+    }
+    note_activity(params->tcp, thread_num);
+
+    NOTE("Thread #%u: Pkt from tcp (buffer size: %zd)\n===\n%s===", thread_num,
+         gotten_size, hexdump(batch->buffer + offset, (int)gotten_size));
+
+    if (!worker->first_usb_byte_seen) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      NOTE("Thread #%u: %ld us from accept to first byte for the printer",
+           thread_num,
+           (long)(now.tv_sec - worker->accepted.tv_sec) * 1000000 +
+               (now.tv_nsec - worker->accepted.tv_nsec) / 1000);
+      worker->first_usb_byte_seen = 1;
+    }
 
-    /* Send pkt to printer. */
-    usb_conn_packet_send(params->usb_conn, pkt);
+    if (offset == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += (long)coalesce_delay * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+    }
 
-    packet_free(pkt);
+    /* Once a request is on its way to the printer the printer thread reads
+       its response. */
+    pthread_mutex_lock(&worker->read_mutex);
+    uint32_t started = worker->request_framer.started;
+    uint32_t ended = frame_requests(worker, thread_num, batch->buffer + offset,
+                                    (size_t)gotten_size);
+    if (worker->request_framer.started != started)
+      pthread_cond_broadcast(params->cond);
+    pthread_mutex_unlock(&worker->read_mutex);
+
+    /* Queue the data for the printer and go on reading from the client while
+       it is being written. */
+    if ((ended || batch->filled_size >= limit) &&
+        flush_to_printer(params, &batch))
+      break;
   }
+
+  /* What the client sent before closing still goes to the printer. */
+  if (batch != NULL && batch->filled_size > 0 && !g_options.terminate)
+    flush_to_printer(params, &batch);
 }
 
-void *service_printer_connection(void *params_void)
+/* Reads the responses from the printer through |usb_conn|, the interface the
+   connection of |params| currently holds, until the lease ends or the
+   connection closes. Called and returns with the read_mutex of the worker
+   held. */
+static void serve_lease(struct service_thread_param *params,
+                        struct usb_conn_t *usb_conn)
 {
-  struct service_thread_param *params =
-      (struct service_thread_param *)params_void;
   uint32_t thread_num = params->thread_num;
-
-  /* Register clean-up handler. */
-  pthread_cleanup_push(cleanup_handler, &thread_num);
+  struct service_worker *worker = params->worker;
+  pthread_mutex_t *read_mutex = &worker->read_mutex;
 
   /* Amount of time to wait in milliseconds before sending another read request
      if we received a 0-byte response from the printer. */
   int backoff = initial_backoff;
 
-  int read_inflight = 0;
-  int empty_response = 0;
-
-  pthread_mutex_t read_inflight_mutex;
-  if (pthread_mutex_init(&read_inflight_mutex, NULL))
-    goto cleanup;
-
-  struct libusb_transfer *read_transfer = NULL;
+  struct libusb_callback_data user_data;
+  memset(&user_data, 0, sizeof(user_data));
+  user_data.thread_num = thread_num;
+  user_data.tcp = params->tcp;
+  user_data.read_inflight_mutex = read_mutex;
+  user_data.read_inflight_cond = params->cond;
+  user_data.response_framer = &params->worker->response_framer;
+  user_data.cache_fill = &params->worker->cache_fill;
+  uint32_t requests_seen = 0;
+
+  if (usb_conn_read_queue_init(usb_conn, g_options.read_queue_depth,
+                               read_transfer_callback, &user_data, read_mutex,
+                               params->cond)) {
+    /* Nothing can be read, let the connection run into its timeout. */
+    while (is_socket_open(params) && !g_options.terminate &&
+           worker->lease == usb_conn)
+      pthread_cond_wait(params->cond, read_mutex);
+    return;
+  }
 
-  while (is_socket_open(params) && !g_options.terminate) {
-    /* If there is already a read from the printer underway, block until it has
-       completed. */
-    pthread_mutex_lock(&read_inflight_mutex);
-    while (is_socket_open(params) && read_inflight)
-      pthread_cond_wait(params->cond, &read_inflight_mutex);
-    pthread_mutex_unlock(&read_inflight_mutex);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (is_socket_open(params) && !g_options.terminate &&
+         worker->lease == usb_conn) {
+    /* Block until a read has completed, or a response is due and another
+       read from the printer may be started. Nothing is read from an idle
+       connection, and nothing more from the printer while the client does
+       not take what it sent. */
+    while (is_socket_open(params) && !g_options.terminate &&
+           worker->lease == usb_conn &&
+           !usb_conn_read_queue_ready(usb_conn) &&
+           (!usb_conn_read_queue_can_fill(usb_conn) ||
+            !response_pending(params->worker)))
+      pthread_cond_wait(params->cond, read_mutex);
+
+    /* Forward what the printer sent. This thread does the writing to the
+       client, the libusb event thread only queues the data. */
+    if (usb_conn_read_queue_deliver(usb_conn)) {
+      /* Let the socket thread give the interface back once the client got
+         all its responses. */
+      if (g_options.multiplex_mode && exchange_done(worker) &&
+          eventfd_write(worker->wake_fd, 1))
+        ERR("Thread #%u: Failed to wake up thread #%u", thread_num,
+            thread_num - 1);
+      continue;
+    }
 
     /* After waking up due to a completed transfer, verify that the socket is
-       still open and that the termination flag has not been set before
-       attempting to start another transfer. */
-    if (!is_socket_open(params) || g_options.terminate)
+       still open, that the interface is still ours and that the termination
+       flag has not been set before attempting to start another transfer. */
+    if (!is_socket_open(params) || g_options.terminate ||
+        worker->lease != usb_conn)
       break;
 
+    /* Empty responses to earlier requests do not delay the response to a new
+       one. */
+    if (params->worker->request_framer.started != requests_seen) {
+      requests_seen = params->worker->request_framer.started;
+      user_data.empty_response = 0;
+      backoff = initial_backoff;
+    }
+
     /* If we received an empty response from the printer then wait for |backoff|
        milliseconds and update the backoff period. */
-    if (empty_response) {
+    if (user_data.empty_response) {
+      user_data.empty_response = 0;
+      pthread_mutex_unlock(read_mutex);
       /* usleep accepts microseconds. */
       usleep(backoff * 1000);
       backoff = update_backoff(backoff);
-      /* Reset the empty response indicator before sending the next read
-         request. A mutex should not be needed here since the transfer callback
-         won't be fired until after calling libusb_submit_transfer(). */
-      empty_response = 0;
-    } else {
-      /* If we received a non-empty response from the printer then reset the
-         backoff to its initial value. */
-      backoff = initial_backoff;
+      pthread_mutex_lock(read_mutex);
+      continue;
     }
 
-    NOTE("Thread #%u: No read in flight, starting a new one", thread_num);
-    struct http_packet_t *pkt = packet_new();
-    if (pkt == NULL) {
-      ERR("Thread #%u: Failed to allocate packet", thread_num);
+    /* If we received a non-empty response from the printer then reset the
+       backoff to its initial value. */
+    backoff = initial_backoff;
+
+    NOTE("Thread #%u: %u of %u reads in flight, starting new ones", thread_num,
+         usb_conn->reads_inflight, usb_conn->read_depth);
+    if (usb_conn_read_queue_fill(usb_conn, 5000) < 0) {
+      ERR("Thread #%u: Failed to submit asynchronous USB transfer", thread_num);
       break;
     }
+  }
 
-    struct libusb_callback_data *user_data = setup_libusb_callback_data(
-        pkt, &read_inflight, &empty_response, params, &read_inflight_mutex);
-
-    if (user_data == NULL) {
-      ERR("Thread #%u: Failed to allocate memory for libusb_callback_data",
-          thread_num);
-      break;
+  /* If the socket used for communication has closed or the lease ended and
+     there are still transfers from the printer in flight then we attempt to
+     cancel them and wait until they are back. */
+  if (usb_conn->reads_inflight) {
+    NOTE("Thread #%u: %u reads in flight when the lease ended, "
+         "cancelling them", thread_num, usb_conn->reads_inflight);
+    if (usb_conn_read_queue_cancel(usb_conn))
+      ERR("Thread #%u: Failed to cancel transfer", thread_num);
+    while (usb_conn->reads_inflight) {
+      if (!usb_conn_read_queue_deliver(usb_conn))
+        pthread_cond_wait(params->cond, read_mutex);
     }
+  }
 
-    read_transfer = setup_async_read(
-        params->usb_conn, pkt, read_transfer_callback, (void *)user_data, 5000);
+  /* The reads are kept for the next lease, which finds them allocated. */
+  uint32_t allocations = usb_conn->read_allocations;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  double megabytes = (double)user_data.bytes_received / 1e6;
+  NOTE("Thread #%u: Received %zu bytes from the printer in %.3f s "
+       "(%.2f MB/s, read queue depth %u, %u allocations, %.2f per MB)",
+       thread_num, user_data.bytes_received, seconds,
+       seconds > 0 ? megabytes / seconds : 0.0, g_options.read_queue_depth,
+       allocations, megabytes > 0 ? allocations / megabytes : 0.0);
+  NOTE("Thread #%u: At most %zu bytes from the printer waited for the client",
+       thread_num, usb_conn->buffered_in_peak);
+}
 
-    if (read_transfer == NULL) {
-      ERR("Thread #%u: Failed to allocate memory for libusb transfer",
-          thread_num);
-      break;
-    }
+static void serve_printer(struct service_thread_param *params)
+{
+  struct service_worker *worker = params->worker;
 
-    /* Mark that there is a new read in flight. A mutex should not be needed
-       here since the transfer callback won't be fired until after calling
-       libusb_submit_transfer() */
-    read_inflight = 1;
+  register_thread(params);
 
-    if (libusb_submit_transfer(read_transfer)) {
-      ERR("Thread #%u: Failed to submit asynchronous USB transfer", thread_num);
-      set_read_inflight(0, &read_inflight_mutex, &read_inflight);
-      break;
+  /* Serve every interface the connection holds in turn. */
+  pthread_mutex_lock(&worker->read_mutex);
+  while (is_socket_open(params) && !g_options.terminate) {
+    if (worker->lease == NULL) {
+      pthread_cond_wait(params->cond, &worker->read_mutex);
+      continue;
     }
-  }
 
-  /* If the socket used for communication has closed and there is still a
-     transfer from the printer in flight then we attempt to cancel it. */
-  if (get_read_inflight(&read_inflight, &read_inflight_mutex)) {
-    NOTE(
-        "Thread #%u: There was a read in flight when the connection was "
-        "closed, cancelling transfer", thread_num);
-    int cancel_status = libusb_cancel_transfer(read_transfer);
-    if (!cancel_status) {
-      /* Wait until the cancellation has completed. */
-      NOTE("Thread #%u: Waiting until the transfer has been cancelled",
-           thread_num);
-      pthread_mutex_lock(&read_inflight_mutex);
-      while (read_inflight)
-        pthread_cond_wait(params->cond, &read_inflight_mutex);
-      pthread_mutex_unlock(&read_inflight_mutex);
-    } else if (cancel_status == LIBUSB_ERROR_NOT_FOUND) {
-      NOTE("Thread #%u: The transfer has already completed", thread_num);
-    } else {
-      NOTE("Thread #%u: Failed to cancel transfer");
-      g_options.terminate = 1;
-    }
+    worker->printer_lease = worker->lease;
+    params->usb_conn = worker->printer_lease;
+    serve_lease(params, worker->printer_lease);
+    params->usb_conn = NULL;
+    worker->printer_lease = NULL;
+    pthread_cond_broadcast(params->cond);
   }
+  pthread_mutex_unlock(&worker->read_mutex);
 
-  pthread_mutex_destroy(&read_inflight_mutex);
+  unregister_thread(params);
+}
+
+void *service_printer_connection(void *worker_void)
+{
+  struct service_worker *worker = (struct service_worker *)worker_void;
+
+  /* Register clean-up handler. */
+  pthread_cleanup_push(cleanup_handler, &worker->printer_param);
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  for (;;) {
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->printer_busy && !g_options.terminate)
+      pthread_cond_wait(&worker->wakeup, &worker->mutex);
+    int busy = worker->printer_busy;
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (!busy)
+      break;
+
+    serve_printer(&worker->printer_param);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->printer_busy = 0;
+    pthread_cond_broadcast(&worker->wakeup);
+    pthread_mutex_unlock(&worker->mutex);
+  }
 
-cleanup:
   /* Execute clean-up handler. */
   pthread_cleanup_pop(1);
   pthread_exit(NULL);
@@ -451,8 +1058,6 @@ cleanup:
 static uint16_t open_tcp_socket(void)
 {
   uint16_t desired_port = g_options.desired_port;
-  g_options.tcp_socket = NULL;
-  g_options.tcp6_socket = NULL;
 
   for (;;) {
     g_options.tcp_socket = tcp_open(desired_port, g_options.interface);
@@ -473,98 +1078,140 @@ static uint16_t open_tcp_socket(void)
   return desired_port;
 }
 
-int allocate_socket_connection(struct service_thread_param *param)
+int setup_socket_connection(struct service_worker *worker, int timeout)
 {
-  param->tcp = calloc(1, sizeof(*param->tcp));
-
-  if (param->tcp == NULL) {
-    ERR("Preparing thread #%u: Failed to allocate space for cups connection",
-        param->thread_num);
+  int status = tcp_conn_select(&listener, &worker->tcp, timeout);
+  if (status > 0 && !g_options.terminate)
+    return 1;
+  if (status || g_options.terminate)
     return -1;
-  }
-
+  clock_gettime(CLOCK_MONOTONIC, &worker->accepted);
+  worker->first_usb_byte_seen = 0;
+  worker->client_reads = 0;
   return 0;
 }
 
-int setup_socket_connection(struct service_thread_param *param)
+/* Allocates the slab of |count| workers and spawns their threads. Returns 0
+   on success and a non-zero value otherwise. */
+static int start_workers(struct usb_sock_t *usb_sock, uint32_t count)
 {
-  param->tcp = tcp_conn_select(g_options.tcp_socket, g_options.tcp6_socket);
-  if (g_options.terminate || param->tcp == NULL)
-    return -1;
-  return 0;
-}
-
-int setup_usb_connection(struct usb_sock_t *usb_sock,
-                         struct service_thread_param *param)
-{
-  param->usb_conn = usb_conn_acquire(usb_sock);
-  if (param->usb_conn == NULL) {
-    ERR("Thread #%u: Failed to acquire usb interface", param->thread_num);
+  workers = calloc(count, sizeof(*workers));
+  if (workers == NULL) {
+    ERR("Failed to alloc space for %u workers", count);
     return -1;
   }
 
-  return 0;
-}
+  for (uint32_t i = 0; i < count; i++) {
+    struct service_worker *worker = workers + i;
 
-int setup_communication_thread(void *(*routine)(void *),
-                               struct service_thread_param *param)
-{
-  pthread_mutex_lock(&thread_register_mutex);
-  register_service_thread(&num_service_threads, &service_threads, param);
-  list_service_threads(num_service_threads, service_threads);
-  pthread_mutex_unlock(&thread_register_mutex);
+    if (tcp_conn_init(&worker->tcp) ||
+        pthread_mutex_init(&worker->mutex, NULL) ||
+        pthread_cond_init(&worker->wakeup, NULL) ||
+        pthread_mutex_init(&worker->read_mutex, NULL) ||
+        pthread_cond_init(&worker->cond, NULL)) {
+      ERR("Preparing worker #%u: Failed to init its state", i);
+      return -1;
+    }
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wake_fd < 0) {
+      ERR("Preparing worker #%u: Failed to create its wake-up event", i);
+      return -1;
+    }
+    worker->usb_conn = usb_conn_new(usb_sock);
+    if (worker->usb_conn == NULL) {
+      ERR("Preparing worker #%u: Failed to alloc its usb conn", i);
+      close(worker->wake_fd);
+      return -1;
+    }
 
-  int status =
-      pthread_create(&param->thread_handle, NULL, routine, param);
-
-  if (status) {
-    ERR("Creating thread #%u: Failed to spawn thread, error %d",
-        param->thread_num, status);
-    pthread_mutex_lock(&thread_register_mutex);
-    unregister_service_thread(&num_service_threads, &service_threads,
-                              param->thread_num);
-    list_service_threads(num_service_threads, service_threads);
-    pthread_mutex_unlock(&thread_register_mutex);
-    return -1;
+    worker->socket_param.tcp = &worker->tcp;
+    worker->socket_param.usb_sock = usb_sock;
+    worker->socket_param.cond = &worker->cond;
+    worker->socket_param.worker = worker;
+    worker->printer_param = worker->socket_param;
+
+    int status = pthread_create(&worker->socket_param.thread_handle, NULL,
+                                &service_connection, worker);
+    if (status == 0) {
+      status = pthread_create(&worker->printer_param.thread_handle, NULL,
+                              &service_printer_connection, worker);
+      if (status) {
+        pthread_cancel(worker->socket_param.thread_handle);
+        pthread_join(worker->socket_param.thread_handle, NULL);
+      }
+    }
+    if (status) {
+      ERR("Creating worker #%u: Failed to spawn threads, error %d", i,
+          status);
+      usb_conn_free(worker->usb_conn);
+      close(worker->wake_fd);
+      return -1;
+    }
+
+    num_workers++;
+    worker->next_free = free_workers;
+    free_workers = worker;
   }
 
+  NOTE("Started %u workers", num_workers);
   return 0;
 }
 
-struct libusb_callback_data *setup_libusb_callback_data(
-    struct http_packet_t *pkt, int *read_inflight, int *empty_response,
-    struct service_thread_param *thread_param,
-    pthread_mutex_t *read_inflight_mutex)
+/* Stops all workers. Connections still being served get their socket shut
+   down, and threads which did not terminate by themselves are cancelled, so
+   that no USB communication with the printer can happen after the final
+   reset. */
+static void stop_workers(void)
 {
-  struct libusb_callback_data *data = calloc(1, sizeof(*data));
-  if (data == NULL)
-    return NULL;
+  uint32_t i;
 
-  data->pkt = pkt;
-  data->read_inflight = read_inflight;
-  data->empty_response = empty_response;
-  data->thread_num = thread_param->thread_num;
-  data->read_inflight_mutex = read_inflight_mutex;
-  data->read_inflight_cond = thread_param->cond;
-  data->tcp = thread_param->tcp;
+  /* Idle workers only wake up to leave once the daemon is terminating. */
+  g_options.terminate = 1;
 
-  return data;
-}
+  for (i = 0; i < num_workers; i++) {
+    struct service_worker *worker = workers + i;
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->state == WORKER_ASSIGNED && worker->tcp.sd >= 0)
+      shutdown(worker->tcp.sd, SHUT_RDWR);
+    pthread_cond_broadcast(&worker->wakeup);
+    pthread_mutex_unlock(&worker->mutex);
+  }
 
-int get_read_inflight(const int *read_inflight, pthread_mutex_t *mtx)
-{
-  pthread_mutex_lock(mtx);
-  int val = *read_inflight;
-  pthread_mutex_unlock(mtx);
+  /* Give busy workers a moment to wrap up. */
+  for (int wait = 0; wait < 10 && for_each_service_thread(NULL, NULL); wait++)
+    usleep(100000);
+  for_each_service_thread(note_service_thread, NULL);
 
-  return val;
-}
+  for (i = 0; i < num_workers; i++) {
+    struct service_worker *worker = workers + i;
 
-void set_read_inflight(int val, pthread_mutex_t *mtx, int *read_inflight)
-{
-  pthread_mutex_lock(mtx);
-  *read_inflight = val;
-  pthread_mutex_unlock(mtx);
+    pthread_mutex_lock(&worker->mutex);
+    int busy = worker->state == WORKER_ASSIGNED || worker->printer_busy;
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (busy) {
+      NOTE("Thread #%u did not terminate, canceling it now ...",
+           worker->socket_param.thread_num);
+      pthread_cancel(worker->socket_param.thread_handle);
+      pthread_cancel(worker->printer_param.thread_handle);
+    }
+    pthread_join(worker->socket_param.thread_handle, NULL);
+    pthread_join(worker->printer_param.thread_handle, NULL);
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    tcp_conn_shutdown(&workers[i].tcp);
+    pthread_mutex_destroy(&workers[i].tcp.mutex);
+    close(workers[i].wake_fd);
+    /* A worker canceled while holding an interface may have left transfers
+       in flight, its connection is left alone then. */
+    if (workers[i].usb_conn->interface == NULL)
+      usb_conn_free(workers[i].usb_conn);
+  }
+  free(workers);
+  workers = NULL;
+  num_workers = 0;
+  free_workers = NULL;
 }
 
 int is_socket_open(const struct service_thread_param *param) {
@@ -580,6 +1227,107 @@ int update_backoff(int backoff) {
   return updated;
 }
 
+/* Takes over the listening sockets systemd passed to us when it started us
+   for a client connecting to them, as described in sd_listen_fds(3). Each
+   one takes the place of the socket of its address family we would have
+   opened ourselves. Returns the number of sockets taken over. */
+static int adopt_listen_fds(void)
+{
+  const char *pid_str = getenv("LISTEN_PID");
+  const char *fds_str = getenv("LISTEN_FDS");
+  if (pid_str == NULL || fds_str == NULL)
+    return 0;
+
+  int adopted = 0;
+  long num_fds = atol(fds_str);
+  if (atol(pid_str) != (long)getpid()) {
+    /* Meant for another process */
+    num_fds = 0;
+  }
+  for (long i = 0; i < num_fds; i++) {
+    int fd = LISTEN_FDS_START + (int)i;
+    struct tcp_sock_t *sock = tcp_sock_adopt(fd);
+    struct tcp_sock_t **slot = NULL;
+    if (sock != NULL) {
+      if (sock->family == AF_INET)
+	slot = &g_options.tcp_socket;
+      else if (sock->family == AF_INET6)
+	slot = &g_options.tcp6_socket;
+      else if (sock->family == AF_UNIX)
+	slot = &g_options.unix_socket;
+    }
+    if (slot == NULL || *slot != NULL) {
+      WARN("Ignoring inherited fd %d, no use for it", fd);
+      if (sock != NULL)
+	tcp_close(sock);
+      else
+	close(fd);
+      continue;
+    }
+    *slot = sock;
+    adopted++;
+  }
+
+  /* Not to be passed on to anything we start */
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return adopted;
+}
+
+/* Tells systemd about |state|, like sd_notify(3), if it started us as a
+   Type=notify service. Does nothing otherwise. */
+static void notify_systemd(const char *state)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  if (path == NULL || (path[0] != '/' && path[0] != '@'))
+    return;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  size_t len = strlen(path);
+  if (len >= sizeof(addr.sun_path)) {
+    ERR("Notify socket path %s is too long", path);
+    return;
+  }
+  memcpy(addr.sun_path, path, len);
+  /* Abstract namespace */
+  if (addr.sun_path[0] == '@')
+    addr.sun_path[0] = '\0';
+
+  int sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0) {
+    ERR("Notify socket open failed");
+    return;
+  }
+  char msg[128];
+  int msg_len = snprintf(msg, sizeof(msg), "%s\nMAINPID=%ld", state,
+			 (long)getpid());
+  if (sendto(sd, msg, (size_t)msg_len, MSG_NOSIGNAL, (struct sockaddr *)&addr,
+	     (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len)) < 0)
+    ERR("Notifying systemd failed: %s", strerror(errno));
+  close(sd);
+}
+
+/* Whether no connection has been served in the threaded mode for
+   |g_options.exit_idle| seconds, counted from |*idle_since| which is moved
+   forward while connections are being served. */
+static int daemon_idle(time_t *idle_since)
+{
+  pthread_mutex_lock(&thread_register_mutex);
+  uint32_t count = num_service_threads;
+  pthread_mutex_unlock(&thread_register_mutex);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (count > 0) {
+    *idle_since = now.tv_sec;
+    return 0;
+  }
+  return now.tv_sec - *idle_since >= (time_t)g_options.exit_idle;
+}
+
 static void start_daemon()
 {
   /* Capture USB device. */
@@ -587,12 +1335,25 @@ static void start_daemon()
 
   /* Termination flag */
   g_options.terminate = 0;
+  g_options.idle_exit = 0;
 
   usb_sock = usb_open();
   if (usb_sock == NULL) goto cleanup_usb;
 
-  /* Capture a socket */
-  uint16_t desired_port = open_tcp_socket();
+  /* Capture a socket, unless systemd holds one for us already */
+  g_options.tcp_socket = NULL;
+  g_options.tcp6_socket = NULL;
+  g_options.unix_socket = NULL;
+  uint16_t desired_port = 0;
+  if (adopt_listen_fds() > 0) {
+    if (g_options.unix_socket != NULL && g_options.unix_socket_path != NULL)
+      NOTE("Using the inherited Unix socket instead of %s",
+           g_options.unix_socket_path);
+    if (g_options.unix_socket != NULL)
+      g_options.unix_socket_path = NULL;
+  }
+  if (g_options.tcp_socket == NULL && g_options.tcp6_socket == NULL)
+    desired_port = open_tcp_socket();
   if (g_options.tcp_socket == NULL && g_options.tcp6_socket == NULL)
     goto cleanup_tcp;
 
@@ -606,6 +1367,14 @@ static void start_daemon()
 	" The requested port number may be too high.");
     goto cleanup_tcp;
   }
+  /* Local clients may also connect without going through TCP */
+  if (g_options.unix_socket_path != NULL) {
+    g_options.unix_socket = tcp_unix_open(g_options.unix_socket_path,
+                                          g_options.unix_socket_mode);
+    if (g_options.unix_socket == NULL)
+      goto cleanup_tcp;
+  }
+
   printf("%u|", g_options.real_port);
   fflush(stdout);
 
@@ -656,60 +1425,99 @@ static void start_daemon()
 
   /* Main loop */
   uint32_t i = 1;
-  pthread_mutex_init(&thread_register_mutex, NULL);
-  while (!g_options.terminate) {
-    struct service_thread_param *args = calloc(1, sizeof(*args));
-    if (args == NULL) {
-      ERR("Preparing thread #%u: Failed to alloc space for thread args", i);
-      goto cleanup_thread;
-    }
+  if (g_options.event_loop_mode) {
+    if (g_options.multiplex_mode)
+      WARN("Sharing interfaces is not supported by the event loop");
+    if (g_options.attr_cache_ttl)
+      WARN("The attribute cache is not supported by the event loop");
+    notify_systemd("READY=1");
+    event_loop_run(usb_sock);
+    goto cleanup_tcp;
+  }
 
-    args->thread_num = i;
-    args->usb_sock = usb_sock;
+  /* Completions of the transfers with the printer are delivered by their own
+     thread, independent of the unplug event observer. */
+  if (usb_start_event_thread(usb_sock))
+    goto cleanup_tcp;
+  struct tcp_sock_t *socks[TCP_LISTENER_MAX] = {
+    g_options.tcp_socket, g_options.tcp6_socket, g_options.unix_socket
+  };
+  if (tcp_listener_init(&listener, socks, TCP_LISTENER_MAX))
+    goto cleanup_tcp;
 
-    /* Allocate space for a tcp socket to be used for communication. */
-    if (allocate_socket_connection(args))
-      goto cleanup_thread;
+  uint32_t pool_size = g_options.num_workers;
+  if (pool_size == 0)
+    pool_size = WORKERS_PER_INTERFACE * usb_sock->num_interfaces;
+  if (g_options.num_workers == 0 && pool_size < WORKERS_MIN)
+    pool_size = WORKERS_MIN;
+  if (start_workers(usb_sock, pool_size))
+    goto cleanup_workers;
+  notify_systemd("READY=1");
+
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  time_t idle_since = started.tv_sec;
+
+  while (!g_options.terminate) {
+    /* Quarantined interfaces are reset when they are due, whether or not a
+       client comes. Without an idle limit or one of them the wait for
+       clients never times out. */
+    int select_timeout = g_options.exit_idle ? 1000 : -1;
+    int recover_in = usb_recover_interfaces(usb_sock);
+    if (recover_in >= 0 && (select_timeout < 0 || recover_in < select_timeout))
+      select_timeout = recover_in;
+    if (g_options.terminate)
+      break;
+
+    struct service_worker *worker = acquire_worker();
+    if (worker == NULL)
+      break;
 
     /* Attempt to establish a connection to the relevant socket. */
-    if (setup_socket_connection(args))
-      goto cleanup_thread;
+    int status = setup_socket_connection(worker, select_timeout);
+    if (status > 0) {
+      release_worker(worker);
+      if (g_options.exit_idle && daemon_idle(&idle_since)) {
+        NOTE("No client for %u s, exiting until the next one comes",
+             g_options.exit_idle);
+        g_options.idle_exit = 1;
+        g_options.terminate = 1;
+        break;
+      }
+      continue;
+    }
+    if (status) {
+      release_worker(worker);
+      break;
+    }
 
-    /* Attempt to start up a new thread to handle the socket's end of
-       communication. */
-    if (setup_communication_thread(&service_connection, args))
-      goto cleanup_thread;
+    /* Hand the connection to the worker's socket thread. */
+    pthread_mutex_lock(&worker->mutex);
+    worker->socket_param.thread_num = i;
+    worker->state = WORKER_ASSIGNED;
+    pthread_cond_broadcast(&worker->wakeup);
+    pthread_mutex_unlock(&worker->mutex);
 
     i += 2;
+  }
 
-    continue;
-
-  cleanup_thread:
-    if (args != NULL) {
-      if (args->tcp != NULL)
-	tcp_conn_close(args->tcp);
-      free(args);
-    }
-    break;
+ cleanup_workers:
+  /* Stop the workers when stopping ippusbxd, so that no USB communication
+     with the printer can happen after the final reset */
+  stop_workers();
+  tcp_listener_close(&listener);
+  if (g_options.attr_cache_ttl) {
+    cache_log_stats();
+    cache_shutdown();
   }
 
  cleanup_tcp:
+  notify_systemd("STOPPING=1");
+
   /* Stop DNS-SD advertising of the printer */
   if (g_options.dnssd_data != NULL)
     dnssd_shutdown();
 
-  /* Cancel communication threads which did not terminate by themselves when
-     stopping ippusbxd, so that no USB communication with the printer can
-     happen after the final reset */
-  while (num_service_threads) {
-    NOTE("Thread #%u did not terminate, canceling it now ...",
-	 service_threads[0]->thread_num);
-    i = num_service_threads;
-    pthread_cancel(service_threads[0]->thread_handle);
-    while (i == num_service_threads)
-      usleep(1000000);
-  }
-
   /* Wait for USB unplug event observer thread to terminate */
   NOTE("Shutting down usb observer thread");
   pthread_join(g_options.usb_event_thread_handle, NULL);
@@ -719,6 +1527,8 @@ static void start_daemon()
     tcp_close(g_options.tcp_socket);
   if (g_options.tcp6_socket!= NULL)
     tcp_close(g_options.tcp6_socket);
+  if (g_options.unix_socket != NULL)
+    tcp_close(g_options.unix_socket);
 
  cleanup_usb:
   /* USB clean-up and final reset of the printer */
@@ -762,6 +1572,23 @@ int main(int argc, char *argv[])
     {"verbose",      no_argument,       0,  'q' },
     {"no-fork",      no_argument,       0,  'n' },
     {"no-broadcast", no_argument,       0,  'B' },
+    {"event-loop",   no_argument,       0,  'e' },
+    {"workers",      required_argument, 0,  'w' },
+    {"read-queue-depth", required_argument, 0, 'r' },
+    {"write-queue-depth", required_argument, 0, 'W' },
+    {"max-buffer",   required_argument, 0,  'M' },
+    {"max-total-buffer", required_argument, 0, 'T' },
+    {"acquire-timeout", required_argument, 0, 'a' },
+    {"multiplex",    no_argument,       0,  'x' },
+    {"reserved-interfaces", required_argument, 0, 'R' },
+    {"listen-backlog", required_argument, 0, 'L' },
+    {"request-timeout", required_argument, 0, 'Q' },
+    {"response-timeout", required_argument, 0, 'Y' },
+    {"keepalive-timeout", required_argument, 0, 'K' },
+    {"unix-socket",  required_argument, 0,  'u' },
+    {"unix-socket-mode", required_argument, 0, 'o' },
+    {"exit-idle",    required_argument, 0,  'I' },
+    {"attr-cache",   required_argument, 0,  'A' },
     {"help",         no_argument,       0,  'h' },
     {NULL,           0,                 0,  0   }
   };
@@ -774,8 +1601,23 @@ int main(int argc, char *argv[])
   g_options.product_id = 0;
   g_options.bus = 0;
   g_options.device = 0;
-
-  while ((c = getopt_long(argc, argv, "qnhdp:P:i:s:lv:m:B",
+  g_options.read_queue_depth = 2;
+  g_options.write_queue_depth = 4;
+  g_options.max_buffer = BUFFER_MAX;
+  g_options.max_total_buffer = BUFFER_TOTAL_MAX;
+  g_options.acquire_timeout = 30;
+  g_options.reserved_interfaces = 1;
+  g_options.listen_backlog = HTTP_MAX_PENDING_CONNS;
+  g_options.request_timeout = 30;
+  g_options.response_timeout = 300;
+  /* Depends on whether interfaces are shared, see below */
+  g_options.keepalive_timeout = 0;
+  g_options.unix_socket_path = NULL;
+  g_options.unix_socket_mode = 0666;
+  g_options.exit_idle = 0;
+  g_options.attr_cache_ttl = 0;
+
+  while ((c = getopt_long(argc, argv, "qnhdp:P:i:s:lv:m:Bew:r:W:M:T:a:xR:L:Q:Y:K:u:o:I:A:",
 			  long_options, &option_index)) != -1) {
     switch (c) {
     case '?':
@@ -851,9 +1693,148 @@ int main(int argc, char *argv[])
     case 'B':
       g_options.nobroadcast = 1;
       break;
+    case 'e':
+      g_options.event_loop_mode = 1;
+      break;
+    case 'w':
+      {
+	long workers = atol(optarg);
+	if (workers < 1 || workers > 1024) {
+	  ERR("Number of workers must be between 1 and 1024");
+	  return 4;
+	}
+	g_options.num_workers = (uint32_t)workers;
+	break;
+      }
+    case 'r':
+      {
+	long depth = atol(optarg);
+	if (depth < 1 || depth > 64) {
+	  ERR("Read queue depth must be between 1 and 64");
+	  return 5;
+	}
+	g_options.read_queue_depth = (uint32_t)depth;
+	break;
+      }
+    case 'W':
+      {
+	long depth = atol(optarg);
+	if (depth < 1 || depth > 64) {
+	  ERR("Write queue depth must be between 1 and 64");
+	  return 6;
+	}
+	g_options.write_queue_depth = (uint32_t)depth;
+	break;
+      }
+    case 'M':
+    case 'T':
+      {
+	long kbytes = atol(optarg);
+	if (kbytes < USB_BUFFER_SIZE / 1024 || kbytes > 1024 * 1024) {
+	  ERR("Buffer limits must be between %d and %d kB",
+	      USB_BUFFER_SIZE / 1024, 1024 * 1024);
+	  return 7;
+	}
+	if (c == 'M')
+	  g_options.max_buffer = (size_t)kbytes * 1024;
+	else
+	  g_options.max_total_buffer = (size_t)kbytes * 1024;
+	break;
+      }
+    case 'x':
+      g_options.multiplex_mode = 1;
+      break;
+    case 'a':
+      {
+	long seconds = atol(optarg);
+	if (seconds < 0 || seconds > 86400) {
+	  ERR("Acquire timeout must be between 0 and 86400 seconds");
+	  return 8;
+	}
+	g_options.acquire_timeout = (uint32_t)seconds;
+	break;
+      }
+    case 'R':
+      {
+	long count = atol(optarg);
+	if (count < 0 || count > 32) {
+	  ERR("Reserved interfaces must be between 0 and 32");
+	  return 9;
+	}
+	g_options.reserved_interfaces = (uint32_t)count;
+	break;
+      }
+    case 'L':
+      {
+	long count = atol(optarg);
+	if (count < 1 || count > 65535) {
+	  ERR("Listen backlog must be between 1 and 65535");
+	  return 10;
+	}
+	g_options.listen_backlog = (uint32_t)count;
+	break;
+      }
+    case 'Q':
+    case 'Y':
+    case 'K':
+      {
+	long seconds = atol(optarg);
+	if (seconds < 1 || seconds > 86400) {
+	  ERR("Timeouts must be between 1 and 86400 seconds");
+	  return 11;
+	}
+	if (c == 'Q')
+	  g_options.request_timeout = (uint32_t)seconds;
+	else if (c == 'Y')
+	  g_options.response_timeout = (uint32_t)seconds;
+	else
+	  g_options.keepalive_timeout = (uint32_t)seconds;
+	break;
+      }
+    case 'u':
+      g_options.unix_socket_path = optarg;
+      break;
+    case 'o':
+      {
+	char *end;
+	unsigned long mode = strtoul(optarg, &end, 8);
+	if (*optarg == '\0' || *end != '\0' || mode > 0777) {
+	  ERR("Unix socket mode must be an octal number up to 0777");
+	  return 12;
+	}
+	g_options.unix_socket_mode = (mode_t)mode;
+	break;
+      }
+    case 'I':
+      {
+	long seconds = atol(optarg);
+	if (seconds < 0 || seconds > 86400) {
+	  ERR("Idle time must be between 0 and 86400 seconds");
+	  return 13;
+	}
+	g_options.exit_idle = (uint32_t)seconds;
+	break;
+      }
+    case 'A':
+      {
+	long seconds = atol(optarg);
+	if (seconds < 0 || seconds > 3600) {
+	  ERR("Attribute cache time must be between 0 and 3600 seconds");
+	  return 14;
+	}
+	g_options.attr_cache_ttl = (uint32_t)seconds;
+	break;
+      }
     }
   }
 
+  /* Unless interfaces are shared, an idle keep-alive connection holds its
+     interface and keeps every other client waiting for it, so it is only
+     kept open briefly. */
+  if (g_options.keepalive_timeout == 0)
+    g_options.keepalive_timeout =
+      g_options.multiplex_mode && !g_options.event_loop_mode ? 30 : 5;
+
   if (g_options.help_mode) {
     printf("Usage: %s -v <vendorid> -m <productid> -s <serial> -P <port>\n"
 	   "       %s --bus <bus> --device <device> -P <port>\n"
@@ -893,6 +1874,57 @@ int main(int argc, char *argv[])
 	   "  -n           No-fork mode\n"
 	   "  --no-broadcast\n"
 	   "  -B           No-broadcast mode, do not DNS-SD-broadcast\n"
+	   "  --event-loop\n"
+	   "  -e           Serve all connections from a single epoll-based event loop\n"
+	   "               instead of two threads per connection\n"
+	   "  --workers <n>\n"
+	   "  -w <n>       Number of connections served at the same time, each by a\n"
+	   "               pre-spawned pair of threads. Default is 8 per IPP-over-USB\n"
+	   "               interface of the printer, at least 16\n"
+	   "  --read-queue-depth <n>\n"
+	   "  -r <n>       Number of reads from the printer kept in flight for each\n"
+	   "               connection (1-64, default 2)\n"
+	   "  --write-queue-depth <n>\n"
+	   "  -W <n>       Number of writes to the printer kept in flight for each\n"
+	   "               connection (1-64, default 4)\n"
+	   "  --max-buffer <kB>\n"
+	   "  -M <kB>      Data a connection may hold in either direction before\n"
+	   "               it stops reading more (default 1024)\n"
+	   "  --max-total-buffer <kB>\n"
+	   "  -T <kB>      Data all connections together may hold (default 16384)\n"
+	   "  --acquire-timeout <s>\n"
+	   "  -a <s>       Time a connection waits in line for a free USB interface,\n"
+	   "               0 for no limit (default 30)\n"
+	   "  --multiplex\n"
+	   "  -x           Hold a USB interface only while a request and its\n"
+	   "               response are underway, not for the whole connection\n"
+	   "  --reserved-interfaces <n>\n"
+	   "  -R <n>       USB interfaces which print jobs and scan jobs leave free\n"
+	   "               for status queries (default 1, at most all but one)\n"
+	   "  --listen-backlog <n>\n"
+	   "  -L <n>       Connections the kernel queues until they are accepted\n"
+	   "               (1-65535, default 128)\n"
+	   "  --request-timeout <s>\n"
+	   "  -Q <s>       Time a client may stay silent in the middle of a request\n"
+	   "               (default 30)\n"
+	   "  --response-timeout <s>\n"
+	   "  -Y <s>       Time a connection may stay silent while the printer works\n"
+	   "               on a response (default 300)\n"
+	   "  --keepalive-timeout <s>\n"
+	   "  -K <s>       Time an idle keep-alive connection is kept open between\n"
+	   "               requests (default 30 with --multiplex, 5 otherwise)\n"
+	   "  --unix-socket <path>\n"
+	   "  -u <path>    Also accept local clients on a Unix domain socket\n"
+	   "  --unix-socket-mode <mode>\n"
+	   "  -o <mode>    Permissions of the Unix domain socket (octal, default\n"
+	   "               0666)\n"
+	   "  --exit-idle <s>\n"
+	   "  -I <s>       Exit once no client has been connected for this long, for\n"
+	   "               systemd socket activation to start us again (default 0,\n"
+	   "               never)\n"
+	   "  --attr-cache <s>\n"
+	   "  -A <s>       Answer Get-Printer-Attributes requests from a cache of the\n"
+	   "               printer's responses for this long (default 0, no cache)\n"
 	   , argv[0], argv[0], argv[0]);
     return 0;
   }
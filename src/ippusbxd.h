@@ -3,7 +3,9 @@
 #include <libusb.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
 
+#include "cache.h"
 #include "tcp.h"
 #include "usb.h"
 
@@ -17,24 +19,95 @@ struct service_thread_param {
   pthread_t thread_handle;
   uint32_t thread_num;
   pthread_cond_t *cond;
+  /* Worker this thread belongs to. */
+  struct service_worker *worker;
+  /* Set while the thread is serving a connection and listed in the registry
+     of service threads, which links the entries through |prev| and |next|. */
+  int registered;
+  struct service_thread_param *prev;
+  struct service_thread_param *next;
+};
+
+enum service_worker_state {
+  WORKER_IDLE,
+  WORKER_ASSIGNED
+};
+
+/* A pre-spawned pair of threads, one per direction, together with all the
+   state needed to serve one client connection. The workers are allocated as
+   one slab when the daemon starts, and the accept loop in start_daemon() hands
+   each accepted connection to an idle one. */
+struct service_worker {
+  struct service_thread_param socket_param;
+  struct service_thread_param printer_param;
+  struct tcp_conn_t tcp;
+  /* Used to broadcast updates to the printer thread, together with
+     |read_mutex| which guards the read queue of the connection. */
+  pthread_cond_t cond;
+  pthread_mutex_t read_mutex;
+  /* Where the requests sent to the printer and its responses begin and end,
+     the printer is only read while a response is due. Guarded by
+     |read_mutex|. */
+  struct http_framer request_framer;
+  struct http_framer response_framer;
+
+  /* The USB interface the connection currently holds, and the one the printer
+     thread reads from, also guarded by |read_mutex|. Without
+     g_options.multiplex_mode the lease lasts for the whole connection,
+     otherwise only from the first byte of a request until its response has
+     been forwarded. |wake_fd| is an eventfd by which the printer thread tells
+     the socket thread that the exchange is complete. */
+  struct usb_conn_t *lease;
+  /* The connection every lease of this worker binds to an interface, made
+     once so that its transfers and buffers last across leases. */
+  struct usb_conn_t *usb_conn;
+  struct usb_conn_t *printer_lease;
+  struct timespec lease_start;
+  int wake_fd;
+
+  /* Guards |state| and |printer_busy|, changes to either are broadcast on
+     |wakeup|. */
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  enum service_worker_state state;
+  int printer_busy;
+
+  /* When the current connection was accepted, and whether the delay until its
+     first byte reached the printer has been logged yet. */
+  struct timespec accepted;
+  int first_usb_byte_seen;
+  /* Reads from the client, which are coalesced into fewer USB writes. */
+  uint32_t client_reads;
+  uint32_t client_polls;
+
+  /* The response to a Get-Printer-Attributes request the cache could not
+     answer, collected as it passes, guarded by |read_mutex|. Whether the
+     operation of the current request has been told to the cache. */
+  struct cache_fill cache_fill;
+  int operation_noted;
+
+  /* Links idle workers. */
+  struct service_worker *next_free;
 };
 
 struct libusb_callback_data {
-  /* Represents whether there is currently an active attempt to read from the
-     printer. */
-  int *read_inflight;
   /*
    * Indicates that the previous read response was empty. This is used to
    * perform exponential backoff in service_printer_connection() to avoid
-   * overloading the printer with read requests when there is nothing to read.
+   * overloading the printer with read requests while a response is due but
+   * not ready yet.
    */
-  int *empty_response;
+  int empty_response;
   uint32_t thread_num;
   struct tcp_conn_t *tcp;
-  /* The contents of the response from the printer. */
-  struct http_packet_t *pkt;
+  /* Guards |empty_response| and the read queue of the connection, changes to
+     either are broadcast on |read_inflight_cond|. */
   pthread_mutex_t *read_inflight_mutex;
   pthread_cond_t *read_inflight_cond;
+  struct http_framer *response_framer;
+  struct cache_fill *cache_fill;
+  /* Bytes forwarded from the printer, for the throughput statistics. */
+  size_t bytes_received;
 };
 
 /* Constants */
@@ -44,67 +117,53 @@ struct libusb_callback_data {
 const int initial_backoff = 100;
 const int maximum_backoff = 1000;
 
+/* Time in milliseconds data from the client may wait for more to be sent
+   along with it to the printer. */
+const int coalesce_delay = 2;
+
+/* Seconds of silence after which connections used to be closed regardless
+   of their HTTP state, to count the reconnects the state-aware timeouts
+   avoid. */
+const int legacy_idle_timeout = 5;
+
+/* Time in milliseconds to wait for enough of a request to tell its traffic
+   class. */
+const int classify_delay = 50;
+
 /* Function prototypes */
 
-/* Handles connection requests and
-   is run in a separate thread. It detaches itself from the main thread and sets
-   up a USB connection with the printer. This function spawns a partner thread
-   which is responsible for reading from the printer, and then this function
-   calls into service_socket_connection() which is responsible for reading from
-   the socket which made the connection request. Once the socket has closed its
+/* Main loop of the socket thread of the worker |worker_void|. It waits until
+   the accept loop hands the worker a connection and then sets up a USB
+   connection with the printer, wakes up the partner printer thread which is
+   responsible for reading from the printer, and calls into
+   service_socket_connection() which is responsible for reading from the
+   socket which made the connection request. Once the socket has closed its
    end of communiction, this function notifies its partner thread that the
-   connection has been closed and then joins on the partner thread before
-   shutting down. */
-void *service_connection(void *params_void);
+   connection has been closed and waits for it to finish before the worker
+   goes back to the pool. */
+void *service_connection(void *worker_void);
 
 /* Reads from the connected socket in |params| and writes any
    received messages to the printer. */
 void service_socket_connection(struct service_thread_param *params);
 
-/* Reads from messages from the printer and writes any responses to the
-   connected socket in |params_void|. */
-void *service_printer_connection(void *params_void);
-
-/* Attempts to allocate space for a tcp socket. If the allocation is
-   successful then a value of 0 is returned, otherwise a non-zero value is
-   returned. */
-int allocate_socket_connection(struct service_thread_param *param);
-
-/* Attempts to setup a connection for to a tcp socket. Returns a 0 value on
-   success and a non-zero value if something went wrong attempting to establish
-   the connection. */
-int setup_socket_connection(struct service_thread_param *param);
-
-/* Attempts to create a new usb_conn_t and assign it to |param| by acquiring an
-   available usb interface. Returns 0 if the creation of the connection struct
-   was successful, and non-zero if there was an error attempting to acquire the
-   interface. */
-int setup_usb_connection(struct usb_sock_t *usb_sock,
-                         struct service_thread_param *param);
-
-/* Attempts to register a new communication thread to execute the function
-   |routine| with the given |params|. Returns 0 if successful, and a non-zero
-   value otherwise. */
-int setup_communication_thread(void *(*routine)(void *),
-                               struct service_thread_param *param);
-
-/* Creates a new libusb_callback_data struct with the given paramaters. */
-struct libusb_callback_data *setup_libusb_callback_data(
-    struct http_packet_t *pkt, int *read_inflight, int *empty_response,
-    struct service_thread_param *thread_param,
-    pthread_mutex_t *read_inflight_mutex);
-
-/* Returns the value of |read_inflight|. The given |read_inflight_mutex| is used
-   to lock changes to |read_inflight| as another thread performing the
-   asynchronous transfer with the printer may change the value upon completion.
- */
-int get_read_inflight(const int *read_inflight,
-                      pthread_mutex_t *read_inflight_mutex);
-
-/* Sets the value of |read_inflight| to |val|. Uses |mtx| as another thread
-   which is processing the asynchronous transfer may change the value once the
-   transfer is complete. */
-void set_read_inflight(int val, pthread_mutex_t *mtx, int *read_inflight);
+/* Main loop of the printer thread of the worker |worker_void|. For every
+   connection the worker serves it reads messages from the printer and writes
+   any responses to the connected socket. */
+void *service_printer_connection(void *worker_void);
+
+/* Attempts to accept the next connection into the socket of |worker|, waiting
+   up to |timeout| milliseconds or without limit if it is negative. Returns 0
+   on success, 1 if no client came in time and -1 if something went wrong
+   attempting to establish the connection. */
+int setup_socket_connection(struct service_worker *worker, int timeout);
+
+/* Calls |callback| with |data| for every thread currently serving a
+   connection and returns the number of such threads. |callback| may be NULL
+   to only count them. The registry is locked during the iteration, so
+   |callback| must not register or unregister threads. */
+uint32_t for_each_service_thread(
+    void (*callback)(struct service_thread_param *, void *), void *data);
 
 /* Returns a non-zero value if the communication socket in |param| is currently
    open for communication. */
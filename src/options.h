@@ -13,8 +13,10 @@
  * limitations under the License. */
 
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #include "dnssd.h"
 
@@ -36,6 +38,34 @@ struct options {
   int verbose_mode;
   int nofork_mode;
   int nobroadcast;
+  int event_loop_mode;
+  int multiplex_mode;
+  uint32_t num_workers;
+  uint32_t read_queue_depth;
+  uint32_t write_queue_depth;
+  /* Bytes a connection may hold in either direction, and all of them
+     together */
+  size_t max_buffer;
+  size_t max_total_buffer;
+  /* Seconds to wait for a free USB interface, 0 for no limit */
+  uint32_t acquire_timeout;
+  /* USB interfaces kept free for interactive requests */
+  uint32_t reserved_interfaces;
+  /* Connections the kernel queues before they are accepted */
+  uint32_t listen_backlog;
+  /* Seconds a connection may stay silent in the middle of a request, while
+     the printer has a response to give and between requests */
+  uint32_t request_timeout;
+  uint32_t response_timeout;
+  uint32_t keepalive_timeout;
+  /* AF_UNIX socket for local clients, NULL for none, and its permissions */
+  char *unix_socket_path;
+  mode_t unix_socket_mode;
+  /* Seconds without any client after which we exit, 0 for never */
+  uint32_t exit_idle;
+  /* Seconds Get-Printer-Attributes responses are answered from the cache,
+     0 for no cache */
+  uint32_t attr_cache_ttl;
 
   /* Printer identity */
   unsigned char *serial_num;
@@ -47,10 +77,13 @@ struct options {
 
   /* Global variables */
   int terminate;
+  /* We are stopping because no client came for exit_idle seconds */
+  int idle_exit;
   dnssd_t *dnssd_data;
   pthread_t usb_event_thread_handle;
   struct tcp_sock_t *tcp_socket;
   struct tcp_sock_t *tcp6_socket;
+  struct tcp_sock_t *unix_socket;
 };
 
 extern struct options g_options;
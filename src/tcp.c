@@ -19,15 +19,22 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <ifaddrs.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -46,6 +53,7 @@ struct tcp_sock_t *tcp_open(uint16_t port, char* interface)
 
   /* Open [S]ocket [D]escriptor */
   this->sd = -1;
+  this->family = AF_INET;
   this->sd = socket(AF_INET, SOCK_STREAM, 0);
   if (this->sd < 0) {
     ERR("IPv4 socket open failed");
@@ -97,7 +105,7 @@ struct tcp_sock_t *tcp_open(uint16_t port, char* interface)
   }
 
   /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
+  if (listen(this->sd, (int)g_options.listen_backlog) < 0) {
     ERR("IPv4 listen failed on socket");
     goto error;
   }
@@ -124,6 +132,7 @@ struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
 
   /* Open [S]ocket [D]escriptor */
   this->sd = -1;
+  this->family = AF_INET6;
   this->sd = socket(AF_INET6, SOCK_STREAM, 0);
   if (this->sd < 0) {
     ERR("Ipv6 socket open failed");
@@ -182,7 +191,7 @@ struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
   }
 
   /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
+  if (listen(this->sd, (int)g_options.listen_backlog) < 0) {
     ERR("IPv6 listen failed on socket");
     goto error;
   }
@@ -199,66 +208,135 @@ struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
   return NULL;
 }
 
-void tcp_close(struct tcp_sock_t *this)
+struct tcp_sock_t *tcp_unix_open(const char *path, mode_t mode)
 {
-  close(this->sd);
-  free(this);
-}
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERR("Unix: Socket path %s is too long", path);
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
 
-uint16_t tcp_port_number_get(struct tcp_sock_t *sock)
-{
-  sock->info_size = sizeof sock->info;
-  int query_status = getsockname(sock->sd,
-				 (struct sockaddr *) &(sock->info),
-				 &(sock->info_size));
-  if (query_status == -1) {
-    ERR("query on socket port number failed");
+  struct tcp_sock_t *this = calloc(1, sizeof *this);
+  if (this == NULL) {
+    ERR("Unix: callocing this failed");
+    return NULL;
+  }
+  this->family = AF_UNIX;
+  this->sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (this->sd < 0) {
+    ERR("Unix socket open failed");
     goto error;
   }
 
-  return ntohs(sock->info.sin6_port);
+  /* Replace the socket of an earlier run, but nothing else */
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      ERR("Unix: %s exists and is not a socket", path);
+      goto error;
+    }
+    unlink(path);
+  }
+
+  if (bind(this->sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ERR("Unix: bind to %s failed: %s", path, strerror(errno));
+    goto error;
+  }
+  this->path = strdup(path);
+  if (this->path == NULL) {
+    unlink(path);
+    goto error;
+  }
+  if (chmod(path, mode) < 0) {
+    ERR("Unix: Setting permissions of %s failed: %s", path, strerror(errno));
+    goto error;
+  }
+  if (listen(this->sd, (int)g_options.listen_backlog) < 0) {
+    ERR("Unix listen failed on socket");
+    goto error;
+  }
+  NOTE("Unix: Listening on %s", path);
+
+  return this;
 
  error:
-  return 0;
+  if (this->sd >= 0)
+    close(this->sd);
+  if (this->path != NULL) {
+    unlink(this->path);
+    free(this->path);
+  }
+  free(this);
+  return NULL;
 }
 
-struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp)
+struct tcp_sock_t *tcp_sock_adopt(int sd)
 {
-  /* Allocate packet for incoming message. */
-  struct http_packet_t *pkt = packet_new();
-  if (pkt == NULL) {
-    ERR("failed to create packet for incoming tcp message");
-    goto error;
+  int type = 0, listening = 0;
+  socklen_t len = sizeof(type);
+  if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+      type != SOCK_STREAM) {
+    ERR("Inherited fd %d is not a stream socket", sd);
+    return NULL;
+  }
+  len = sizeof(listening);
+  if (getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 ||
+      !listening) {
+    ERR("Inherited fd %d is not listening", sd);
+    return NULL;
   }
 
-  struct timeval tv;
-  tv.tv_sec = 3;
-  tv.tv_usec = 0;
-  if (setsockopt(tcp->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
-    ERR("TCP: Setting options for tcp connection socket failed");
-    goto error;
+  struct tcp_sock_t *this = calloc(1, sizeof *this);
+  if (this == NULL) {
+    ERR("Adopting socket: callocing this failed");
+    return NULL;
   }
+  struct sockaddr_storage addr;
+  len = sizeof(addr);
+  if (getsockname(sd, (struct sockaddr *)&addr, &len) < 0) {
+    ERR("Inherited fd %d: getsockname failed: %s", sd, strerror(errno));
+    free(this);
+    return NULL;
+  }
+  this->sd = sd;
+  this->family = addr.ss_family;
+  fcntl(sd, F_SETFD, FD_CLOEXEC);
+  NOTE("Adopted inherited %s socket on fd %d",
+       this->family == AF_INET ? "IPv4" :
+       this->family == AF_INET6 ? "IPv6" :
+       this->family == AF_UNIX ? "Unix" : "unknown", sd);
 
-  ssize_t gotten_size = recv(tcp->sd, pkt->buffer, pkt->buffer_capacity, 0);
+  return this;
+}
 
-  if (gotten_size < 0) {
-    int errno_saved = errno;
-    ERR("recv failed with err %d:%s", errno_saved, strerror(errno_saved));
-    tcp->is_closed = 1;
-    goto error;
+void tcp_close(struct tcp_sock_t *this)
+{
+  close(this->sd);
+  if (this->path != NULL) {
+    unlink(this->path);
+    free(this->path);
   }
+  free(this);
+}
 
-  if (gotten_size == 0) {
-    tcp->is_closed = 1;
+uint16_t tcp_port_number_get(struct tcp_sock_t *sock)
+{
+  sock->info_size = sizeof sock->info;
+  int query_status = getsockname(sock->sd,
+				 (struct sockaddr *) &(sock->info),
+				 &(sock->info_size));
+  if (query_status == -1) {
+    ERR("query on socket port number failed");
+    goto error;
   }
 
-  pkt->filled_size = gotten_size;
-  return pkt;
+  return ntohs(sock->info.sin6_port);
 
  error:
-  if (pkt != NULL)
-    packet_free(pkt);
-  return NULL;
+  return 0;
 }
 
 int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
@@ -291,69 +369,154 @@ int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
 }
 
 
-struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6)
+int tcp_conn_init(struct tcp_conn_t *conn)
 {
-  struct tcp_conn_t *conn = calloc(1, sizeof *conn);
-  if (conn == NULL) {
-    ERR("Calloc for connection struct failed");
-    goto error;
-  }
+  memset(conn, 0, sizeof(*conn));
+  conn->sd = -1;
+  conn->is_closed = 1;
 
-  fd_set rfds;
-  int retval = 0;
-  int nfds = 0;
-  FD_ZERO(&rfds);
-  if (sock) {
-    FD_SET(sock->sd, &rfds);
-    nfds = sock->sd;
-  }
-  if (sock6) {
-    FD_SET(sock6->sd, &rfds);
-    if (sock6->sd > nfds)
-      nfds = sock6->sd;
-  }
-  if (nfds == 0) {
-    ERR("No valid TCP socket supplied.");
-    goto error;
-  }
-  nfds += 1;
-  retval = select(nfds, &rfds, NULL, NULL, NULL);
-  if (g_options.terminate)
-    goto error;
-  if (retval < 1) {
-    ERR("Failed to open tcp connection");
-    goto error;
+  /* Attempt to initialize the connection's mutex. */
+  if (pthread_mutex_init(&conn->mutex, NULL)) {
+    ERR("Failed to init connection mutex");
+    return -1;
   }
-  if (sock && FD_ISSET(sock->sd, &rfds)) {
-    conn->sd = accept(sock->sd, NULL, NULL);
-    NOTE ("Using IPv4");
-  } else if (sock6 && FD_ISSET(sock6->sd, &rfds)) {
-    conn->sd = accept(sock6->sd, NULL, NULL);
-    NOTE ("Using IPv6");
-  } else {
-    ERR("select failed");
-    goto error;
+  return 0;
+}
+
+static time_t tcp_now(void);
+
+/* Sets the options of a client socket |sd| freshly accepted on |sock|, once
+   for the whole connection. Responses and the small requests of status
+   polls are sent as soon as they are complete instead of being held back by
+   Nagle's algorithm. */
+static void tcp_conn_configure(struct tcp_sock_t *sock, int sd)
+{
+  if (sock->family == AF_UNIX)
+    return;
+  int one = 1;
+  if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+    NOTE("TCP: Failed to disable Nagle's algorithm: %s", strerror(errno));
+}
+
+int tcp_listener_init(struct tcp_listener *listener, struct tcp_sock_t **socks,
+		      int num_socks)
+{
+  memset(listener, 0, sizeof(*listener));
+  for (int i = 0; i < num_socks && i < TCP_LISTENER_MAX; i++)
+    listener->socks[i] = socks[i];
+
+  listener->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (listener->epfd < 0) {
+    ERR("Failed to create epoll instance for the listening sockets");
+    return -1;
   }
-  if (conn->sd < 0) {
-    ERR("accept failed");
-    goto error;
+
+  for (int i = 0; i < TCP_LISTENER_MAX; i++) {
+    if (listener->socks[i] == NULL)
+      continue;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = (uint32_t)i;
+    if (tcp_sock_set_nonblocking(listener->socks[i]) ||
+	epoll_ctl(listener->epfd, EPOLL_CTL_ADD, listener->socks[i]->sd,
+		  &event) < 0) {
+      ERR("Failed to watch listening socket");
+      tcp_listener_close(listener);
+      return -1;
+    }
+    /* Clients may be queued already */
+    listener->ready[i] = 1;
   }
 
-  /* Attempt to initialize the connection's mutex. */
-  if (pthread_mutex_init(&conn->mutex, NULL))
-    goto error;
+  return 0;
+}
 
-  return conn;
+void tcp_listener_close(struct tcp_listener *listener)
+{
+  if (listener->epfd >= 0)
+    close(listener->epfd);
+  listener->epfd = -1;
+}
 
- error:
-  if (conn != NULL)
-    free(conn);
-  return NULL;
+int tcp_conn_select(struct tcp_listener *listener, struct tcp_conn_t *conn,
+		    int timeout)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (!g_options.terminate) {
+    /* Drain the sockets which reported connections before waiting again */
+    for (int i = 0; i < TCP_LISTENER_MAX; i++) {
+      if (!listener->ready[i])
+	continue;
+
+      struct tcp_sock_t *sock = listener->socks[i];
+      int sd = accept4(sock->sd, NULL, NULL, SOCK_CLOEXEC);
+      if (sd >= 0) {
+	tcp_conn_configure(sock, sd);
+	conn->sd = sd;
+	conn->is_closed = 0;
+	conn->last_activity = tcp_now();
+	listener->burst++;
+	NOTE("Using %s", sock->family == AF_INET ? "IPv4" :
+	     sock->family == AF_INET6 ? "IPv6" : "Unix socket");
+	return 0;
+      }
+
+      switch (errno) {
+      case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+      case EWOULDBLOCK:
+#endif
+	listener->ready[i] = 0;
+	break;
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+	/* The next one may be fine */
+	break;
+      default:
+	ERR("accept failed with err %d:%s", errno, strerror(errno));
+	return -1;
+      }
+    }
+
+    if (listener->burst > 1)
+      NOTE("TCP: Accepted %u connections in one wakeup", listener->burst);
+    listener->burst = 0;
+
+    /* Wake up regularly as the termination flag is set from a signal
+       handler. */
+    int wait = 1000;
+    if (timeout >= 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+	(now.tv_nsec - start.tv_nsec) / 1000000;
+      if (elapsed >= timeout)
+	return 1;
+      if (timeout - elapsed < wait)
+	wait = (int)(timeout - elapsed);
+    }
+    struct epoll_event events[TCP_LISTENER_MAX];
+    int n = epoll_wait(listener->epfd, events, TCP_LISTENER_MAX, wait);
+    if (n < 0 && errno != EINTR) {
+      ERR("epoll_wait failed with err %d:%s", errno, strerror(errno));
+      return -1;
+    }
+    for (int i = 0; i < n; i++)
+      listener->ready[events[i].data.u32] = 1;
+  }
+
+  return -1;
 }
 
-void tcp_conn_close(struct tcp_conn_t *conn)
+void tcp_conn_shutdown(struct tcp_conn_t *conn)
 {
+  if (conn->sd < 0)
+    return;
+
   /* Unbind host/port cleanly even with pending requests. Otherwise
      the port will stay unavailable for a certain kernel-defined
      timeout. See also
@@ -361,35 +524,253 @@ void tcp_conn_close(struct tcp_conn_t *conn)
   shutdown(conn->sd, SHUT_RDWR);
 
   close(conn->sd);
+  conn->sd = -1;
+  conn->is_closed = 1;
+}
+
+int tcp_sock_set_nonblocking(struct tcp_sock_t *sock)
+{
+  int flags = fcntl(sock->sd, F_GETFL, 0);
+  if (flags < 0 || fcntl(sock->sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    ERR("TCP: Failed to make listening socket non-blocking");
+    return -1;
+  }
+  return 0;
+}
+
+struct tcp_conn_t *tcp_conn_accept(struct tcp_sock_t *sock)
+{
+  int sd = accept4(sock->sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      ERR("accept failed with err %d:%s", errno, strerror(errno));
+    return NULL;
+  }
+
+  tcp_conn_configure(sock, sd);
+
+  struct tcp_conn_t *conn = malloc(sizeof *conn);
+  if (conn == NULL) {
+    ERR("Malloc for connection struct failed");
+    close(sd);
+    return NULL;
+  }
+  if (tcp_conn_init(conn)) {
+    close(sd);
+    free(conn);
+    return NULL;
+  }
+  conn->sd = sd;
+  conn->is_closed = 0;
+  conn->last_activity = tcp_now();
+
+  return conn;
+}
+
+ssize_t tcp_conn_recv(struct tcp_conn_t *conn, struct http_packet_t *pkt)
+{
+  ssize_t gotten_size = recv(conn->sd, pkt->buffer, pkt->buffer_capacity, 0);
+
+  if (gotten_size < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return -1;
+    ERR("recv failed with err %d:%s", errno, strerror(errno));
+    conn->is_closed = 1;
+    return -1;
+  }
+
+  if (gotten_size == 0)
+    conn->is_closed = 1;
+
+  pkt->filled_size = (size_t)gotten_size;
+  return gotten_size;
+}
+
+ssize_t tcp_conn_peek(struct tcp_conn_t *conn, uint8_t *buf, size_t len)
+{
+  ssize_t gotten_size = recv(conn->sd, buf, len, MSG_PEEK | MSG_DONTWAIT);
+
+  if (gotten_size < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return -1;
+    ERR("recv failed with err %d:%s", errno, strerror(errno));
+    conn->is_closed = 1;
+    return -1;
+  }
+
+  if (gotten_size == 0)
+    conn->is_closed = 1;
+
+  return gotten_size;
+}
+
+int tcp_conn_skip(struct tcp_conn_t *conn, size_t len)
+{
+  uint8_t buf[1024];
+
+  while (len > 0) {
+    ssize_t gotten_size = recv(conn->sd, buf,
+			       len < sizeof(buf) ? len : sizeof(buf), 0);
+    if (gotten_size < 0 && errno == EINTR)
+      continue;
+    if (gotten_size <= 0) {
+      conn->is_closed = 1;
+      return -1;
+    }
+    len -= (size_t)gotten_size;
+  }
+
+  return 0;
+}
+
+ssize_t tcp_conn_send(struct tcp_conn_t *conn, const uint8_t *buf, size_t len)
+{
+  ssize_t sent = send(conn->sd, buf, len, MSG_NOSIGNAL);
+
+  if (sent < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return -1;
+    if (errno != EPIPE && errno != ECONNRESET)
+      ERR("Failed to sent data over TCP");
+    conn->is_closed = 1;
+    return -1;
+  }
+
+  return sent;
+}
+
+void tcp_conn_close(struct tcp_conn_t *conn)
+{
+  tcp_conn_shutdown(conn);
   pthread_mutex_destroy(&conn->mutex);
   free(conn);
 }
 
 /* Poll the tcp socket to determine if it is ready to transmit data. */
-int poll_tcp_socket(struct tcp_conn_t *tcp)
+ssize_t tcp_packet_append(struct tcp_conn_t *tcp, struct http_packet_t *pkt,
+			  size_t limit)
+{
+  if (limit > pkt->buffer_capacity)
+    limit = pkt->buffer_capacity;
+  if (pkt->filled_size >= limit)
+    return -1;
+
+  ssize_t gotten_size = recv(tcp->sd, pkt->buffer + pkt->filled_size,
+			     limit - pkt->filled_size, MSG_DONTWAIT);
+  if (gotten_size < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return -1;
+    ERR("recv failed with err %d:%s", errno, strerror(errno));
+    tcp->is_closed = 1;
+    return -1;
+  }
+
+  if (gotten_size == 0)
+    tcp->is_closed = 1;
+
+  pkt->filled_size += (size_t)gotten_size;
+  return gotten_size;
+}
+
+int tcp_conn_poll(struct tcp_conn_t *tcp, int timeout)
 {
   struct pollfd poll_fd;
   poll_fd.fd = tcp->sd;
   poll_fd.events = POLLIN;
-  const int nfds = 1;
-  const int timeout = 5000;  /* 5 seconds. */
 
-  int result = poll(&poll_fd, nfds, timeout);
+  int result = poll(&poll_fd, 1, timeout);
   if (result < 0) {
+    if (errno == EINTR)
+      return 0;
     ERR("poll failed with error %d:%s", errno, strerror(errno));
     tcp->is_closed = 1;
-  } else if (result == 0) {
-    /* In the case where the poll timed out, check to see whether or not data
-     * has recently been sent from the printer along the socket. If so, then we
-     * keep the connection alive an reset the is_active flag. Otherwise, close
-     * the connection. */
-    if (get_is_active(tcp)) {
-      set_is_active(tcp, 0);
-    } else {
-      tcp->is_closed = 1;
+  }
+  return result;
+}
+
+int tcp_conn_wait_more(struct tcp_conn_t *tcp, size_t have, int timeout)
+{
+  if (have == 0)
+    return tcp_conn_poll(tcp, timeout);
+
+  /* poll() would report the bytes already there right away, an
+     edge-triggered epoll instance only what arrives after it was set up. */
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    ERR("Failed to create epoll instance, error %d:%s", errno,
+        strerror(errno));
+    return -1;
+  }
+
+  int result = -1;
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, tcp->sd, &event)) {
+    ERR("epoll_ctl failed with err %d:%s", errno, strerror(errno));
+    goto cleanup;
+  }
+
+  /* Adding the socket reports what is there already. More may have arrived
+     since the caller looked, and if the client closed its side, nothing
+     will. */
+  int queued = 0;
+  result = 0;
+  if (epoll_wait(epfd, &event, 1, 0) > 0 &&
+      (event.events & (EPOLLRDHUP | EPOLLHUP)))
+    goto cleanup;
+  if (ioctl(tcp->sd, FIONREAD, &queued) == 0 && (size_t)queued > have) {
+    result = 1;
+    goto cleanup;
+  }
+
+  result = epoll_wait(epfd, &event, 1, timeout);
+  if (result < 0) {
+    if (errno == EINTR)
+      result = 0;
+    else
+      ERR("epoll_wait failed with err %d:%s", errno, strerror(errno));
+  }
+
+ cleanup:
+  close(epfd);
+  return result;
+}
+
+static time_t tcp_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+int poll_tcp_socket_wake(struct tcp_conn_t *tcp, int wake_fd, int timeout)
+{
+  struct pollfd poll_fds[2];
+  poll_fds[0].fd = tcp->sd;
+  poll_fds[0].events = POLLIN;
+  poll_fds[0].revents = 0;
+  /* Negative descriptors are ignored by poll() */
+  poll_fds[1].fd = wake_fd;
+  poll_fds[1].events = POLLIN;
+  poll_fds[1].revents = 0;
+  const nfds_t nfds = 2;
+
+  int result = poll(poll_fds, nfds, timeout);
+  if (result < 0) {
+    if (errno == EINTR)
+      return 0;
+    ERR("poll failed with error %d:%s", errno, strerror(errno));
+    tcp->is_closed = 1;
+  } else if (result > 0) {
+    if (poll_fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(wake_fd, &count, sizeof(count)) < 0)
+	NOTE("Failed to reset wake-up event");
+      if (poll_fds[0].revents == 0)
+	return 0;
     }
-  } else {
-    if (poll_fd.revents != POLLIN) {
+    if (poll_fds[0].revents != POLLIN) {
       ERR("poll returned an unexpected event");
       tcp->is_closed = 1;
       return -1;
@@ -399,18 +780,23 @@ int poll_tcp_socket(struct tcp_conn_t *tcp)
   return result;
 }
 
-int get_is_active(struct tcp_conn_t *tcp)
+time_t tcp_conn_touch(struct tcp_conn_t *tcp)
 {
+  time_t now = tcp_now();
   pthread_mutex_lock(&tcp->mutex);
-  int val = tcp->is_active;
+  time_t silence = now - tcp->last_activity;
+  tcp->last_activity = now;
   pthread_mutex_unlock(&tcp->mutex);
 
-  return val;
+  return silence;
 }
 
-void set_is_active(struct tcp_conn_t *tcp, int val)
+time_t tcp_conn_idle_time(struct tcp_conn_t *tcp)
 {
+  time_t now = tcp_now();
   pthread_mutex_lock(&tcp->mutex);
-  tcp->is_active = val;
+  time_t idle = now - tcp->last_activity;
   pthread_mutex_unlock(&tcp->mutex);
+
+  return idle;
 }
@@ -18,44 +18,129 @@
 #include <pthread.h>
 
 #include <sys/types.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "http.h"
 
-#define HTTP_MAX_PENDING_CONNS 0
+/* Default length of the queue of connections the kernel completes before
+   they are accepted */
+#define HTTP_MAX_PENDING_CONNS 128
 #define BUFFER_STEP (1 << 13)
 #define BUFFER_STEP_RATIO (2)
 #define BUFFER_INIT_RATIO (1)
 #define BUFFER_MAX (1 << 20)
+/* Default of the bytes all connections together may hold */
+#define BUFFER_TOTAL_MAX (16 * BUFFER_MAX)
 
 struct tcp_sock_t {
   int sd;
+  /* AF_INET, AF_INET6 or AF_UNIX */
+  int family;
+  /* Where an AF_UNIX socket is bound, removed again by tcp_close() */
+  char *path;
   struct sockaddr_in6 info;
   socklen_t info_size;
 };
 
+/* The listening sockets, watched with epoll, and which of them may still have
+   connections pending since the last wakeup. */
+#define TCP_LISTENER_MAX 3
+
+struct tcp_listener {
+  int epfd;
+  struct tcp_sock_t *socks[TCP_LISTENER_MAX];
+  int ready[TCP_LISTENER_MAX];
+  /* Connections accepted since the last wakeup */
+  uint32_t burst;
+};
+
 struct tcp_conn_t {
   int sd;
   int is_closed;
-  int is_active;
+  /* Monotonic time in seconds of the last data in either direction, guarded
+     by |mutex| */
+  time_t last_activity;
   pthread_mutex_t mutex;
 };
 
 struct tcp_sock_t *tcp_open(uint16_t, char* interface);
 struct tcp_sock_t *tcp6_open(uint16_t, char* interface);
+/* Listens for local clients on an AF_UNIX socket at |path|, with the
+   permissions |mode|. A socket left at |path| by an earlier run is
+   replaced. */
+struct tcp_sock_t *tcp_unix_open(const char *path, mode_t mode);
+/* Wraps |sd|, a listening stream socket inherited from whoever started us,
+   such as systemd. Its path, if it is an AF_UNIX one, belongs to them and is
+   left in place by tcp_close(). */
+struct tcp_sock_t *tcp_sock_adopt(int sd);
 void tcp_close(struct tcp_sock_t *);
 uint16_t tcp_port_number_get(struct tcp_sock_t *);
 
-struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6);
+/* Makes the |num_socks| sockets of |socks|, up to TCP_LISTENER_MAX of which
+   any may be NULL, non-blocking and watches them with a new epoll
+   instance. */
+int tcp_listener_init(struct tcp_listener *, struct tcp_sock_t **socks,
+		      int num_socks);
+void tcp_listener_close(struct tcp_listener *);
+
+/* Connections may live in caller-provided memory: tcp_conn_init() prepares
+   one once, tcp_conn_select() waits for and accepts the next client into it
+   and tcp_conn_shutdown() closes the client socket so that the memory can be
+   used for the next one. tcp_conn_close() also frees a heap-allocated
+   connection. tcp_conn_select() only waits once every connection pending on
+   the sockets of |listener| has been accepted, for up to |timeout|
+   milliseconds or without limit if it is negative, and returns 1 if no client
+   came in that time. */
+int tcp_conn_init(struct tcp_conn_t *);
+int tcp_conn_select(struct tcp_listener *listener, struct tcp_conn_t *conn,
+		    int timeout);
+void tcp_conn_shutdown(struct tcp_conn_t *);
 void tcp_conn_close(struct tcp_conn_t *);
 
-struct http_packet_t *tcp_packet_get(struct tcp_conn_t *);
+/* Non-blocking primitives used by the event loop. tcp_conn_accept() takes one
+   pending connection off |sock| and returns NULL once none is left.
+   tcp_conn_recv() and tcp_conn_send() return -1 with errno set to EAGAIN when
+   the socket is not ready, otherwise they behave like recv() and send() and
+   set is_closed when the peer went away. */
+int tcp_sock_set_nonblocking(struct tcp_sock_t *);
+struct tcp_conn_t *tcp_conn_accept(struct tcp_sock_t *);
+ssize_t tcp_conn_recv(struct tcp_conn_t *, struct http_packet_t *);
+ssize_t tcp_conn_send(struct tcp_conn_t *, const uint8_t *, size_t);
+/* Copies up to |len| bytes of what the client has sent so far into |buf|,
+   leaving them to be received. Returns like tcp_conn_recv(). */
+ssize_t tcp_conn_peek(struct tcp_conn_t *, uint8_t *buf, size_t len);
+/* Receives and drops |len| bytes the client has sent, waiting for them if
+   needed. Returns 0 on success and -1 if the connection closed first. */
+int tcp_conn_skip(struct tcp_conn_t *, size_t len);
+
+/* Receives what the client has sent so far into the free space of |pkt|, up
+   to |limit| bytes of it in total, without waiting for more. Returns the
+   number of bytes added, 0 if the client closed the connection and -1 if
+   there was nothing to receive or an error, in which case is_closed is
+   set. */
+ssize_t tcp_packet_append(struct tcp_conn_t *, struct http_packet_t *pkt,
+			  size_t limit);
 int tcp_packet_send(struct tcp_conn_t *, struct http_packet_t *);
 
-int poll_tcp_socket(struct tcp_conn_t *tcp);
+/* Waits up to |timeout| milliseconds for the client to send something, like
+   poll(), but also returns 0 early once |wake_fd|, an eventfd, has been
+   signalled, and resets it. A timeout does not close the connection, the
+   caller decides whether it has been idle for too long. */
+int poll_tcp_socket_wake(struct tcp_conn_t *tcp, int wake_fd, int timeout);
+/* Waits up to |timeout| milliseconds for the client to send something, like
+   poll(). */
+int tcp_conn_poll(struct tcp_conn_t *tcp, int timeout);
+/* Waits up to |timeout| milliseconds for the client to send more than the
+   |have| bytes waiting to be received already. Returns a positive value if
+   it did, 0 on timeout or once the client closed its side and -1 on
+   error. */
+int tcp_conn_wait_more(struct tcp_conn_t *tcp, size_t have, int timeout);
 
-int get_is_active(struct tcp_conn_t *tcp);
-void set_is_active(struct tcp_conn_t *tcp, int val);
+/* Records data passing through the connection in either direction and
+   returns the seconds of silence before it. */
+time_t tcp_conn_touch(struct tcp_conn_t *tcp);
+/* Returns the seconds since data last passed through the connection. */
+time_t tcp_conn_idle_time(struct tcp_conn_t *tcp);
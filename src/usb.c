@@ -207,6 +207,19 @@ static int try_claim_usb_interface(struct usb_sock_t *usb,
   return 0;
 }
 
+/* Sets how many of the pooled interfaces are reserved for interactive
+   requests, at most all but one, with |pool_manage_lock| held once threads
+   use the pool. */
+static void usb_pool_reserve(struct usb_sock_t *usb)
+{
+  uint32_t reserved = g_options.reserved_interfaces;
+  if (reserved >= usb->num_pooled)
+    reserved = usb->num_pooled > 0 ? usb->num_pooled - 1 : 0;
+  __atomic_store_n(&usb->num_reserved, reserved, __ATOMIC_SEQ_CST);
+  NOTE("USB: %u of %u interfaces reserved for interactive requests",
+       reserved, usb->num_pooled);
+}
+
 struct usb_sock_t *usb_open()
 {
   int status_lock;
@@ -398,17 +411,12 @@ struct usb_sock_t *usb_open()
 	/* High bit set means endpoint
 	   is an INPUT or IN endpoint. */
 	uint8_t address = end->bEndpointAddress;
-	if (address & 0x80)
+	if (address & 0x80) {
 	  uf->endpoint_in = address;
-	else
+	} else {
 	  uf->endpoint_out = address;
-      }
-
-      status_lock = sem_init(&uf->lock, 0, 1);
-      if (status_lock != 0) {
-	ERR("Failed to create interface lock #%d",
-	    interf_num);
-	goto error;
+	  uf->max_packet_out = end->wMaxPacketSize;
+	}
       }
 
       /* Try to make the kernel release the usb interface. */
@@ -435,17 +443,16 @@ struct usb_sock_t *usb_open()
   libusb_free_device_list(device_list, 1);
 
   /* Pour interfaces into pool ==--------------------------------------== */
-  usb->num_avail = usb->num_interfaces;
-  usb->interface_pool = calloc(usb->num_avail,
-			       sizeof(*usb->interface_pool));
-  if (usb->interface_pool == NULL) {
-    ERR("Failed to alloc interface pool");
-    goto error;
+  usb->num_pooled = usb->num_interfaces;
+  if (usb->num_pooled > USB_MAX_INTERFACES) {
+    NOTE("Only using %d of the %u IPP-USB interfaces", USB_MAX_INTERFACES,
+	 usb->num_interfaces);
+    usb->num_pooled = USB_MAX_INTERFACES;
   }
-  for (uint32_t i = 0; i < usb->num_avail; i++) {
-    usb->interface_pool[i] = i;
-  }
-  NOTE("USB interfaces pool: %d interfaces", usb->num_avail);
+  usb->free_mask = usb->num_pooled == 64 ? ~0ULL :
+    (1ULL << usb->num_pooled) - 1;
+  usb_pool_reserve(usb);
+  NOTE("USB interfaces pool: %u interfaces", usb->num_pooled);
 
   /* Stale lock */
   status_lock = sem_init(&usb->num_staled_lock, 0, 1);
@@ -455,12 +462,19 @@ struct usb_sock_t *usb_open()
   }
 
   /* Pool management lock */
-  status_lock = sem_init(&usb->pool_manage_lock, 0, 1);
+  status_lock = pthread_mutex_init(&usb->pool_manage_lock, NULL);
   if (status_lock != 0) {
     ERR("Failed to create pool management lock");
     goto error;
   }
 
+  /* Buffer accounting lock */
+  status_lock = sem_init(&usb->buffered_lock, 0, 1);
+  if (status_lock != 0) {
+    ERR("Failed to create buffer accounting lock");
+    goto error;
+  }
+
   return usb;
 
  error:
@@ -472,8 +486,6 @@ struct usb_sock_t *usb_open()
       libusb_exit(usb->context);
     if (usb->interfaces != NULL)
       free(usb->interfaces);
-    if (usb->interface_pool != NULL)
-      free(usb->interface_pool);
     free(usb);
   }
   return NULL;
@@ -481,16 +493,40 @@ struct usb_sock_t *usb_open()
 
 void usb_close(struct usb_sock_t *usb)
 {
+  usb_stop_event_thread(usb);
+
   /* Release interfaces */
   for (uint32_t i = 0; i < usb->num_interfaces; i++) {
     int number = usb->interfaces[i].interface_number;
     libusb_release_interface(usb->printer, number);
-    sem_destroy(&usb->interfaces[i].lock);
   }
 
-  NOTE("Resetting printer ...");
-  libusb_reset_device(usb->printer);
-  NOTE("Reset completed.");
+  for (int i = 0; i < HTTP_CLASS_COUNT; i++) {
+    struct usb_class_stats *stats = usb->class_stats + i;
+    if (stats->acquired == 0)
+      continue;
+    NOTE("USB: %u %s requests got an interface, %u of them after waiting, "
+	 "%llu ms on average, at most %llu ms",
+	 stats->acquired, http_class_name((enum http_class)i), stats->queued,
+	 (unsigned long long)(stats->wait_total / stats->acquired / 1000),
+	 (unsigned long long)(stats->wait_max / 1000));
+  }
+
+  /* After an idle exit every interface came back in a known state and the
+     next client starts us again. A reset then only costs the printer its
+     state, and it may come back on the bus as a new device. Interfaces
+     which failed still call for one. */
+  int reset = !g_options.idle_exit;
+  for (uint32_t i = 0; i < usb->num_interfaces; i++)
+    if (usb->interfaces[i].quarantined || usb->interfaces[i].retired)
+      reset = 1;
+  if (reset) {
+    NOTE("Resetting printer ...");
+    libusb_reset_device(usb->printer);
+    NOTE("Reset completed.");
+  } else {
+    NOTE("Leaving the idle printer as it is, without a reset");
+  }
   NOTE("Closing device handle...");
   libusb_close(usb->printer);
   NOTE("Closed device handle.");
@@ -499,10 +535,10 @@ void usb_close(struct usb_sock_t *usb)
     if (usb->context != NULL)
       libusb_exit(usb->context);
     sem_destroy(&usb->num_staled_lock);
+    sem_destroy(&usb->buffered_lock);
+    pthread_mutex_destroy(&usb->pool_manage_lock);
     if (usb->interfaces != NULL)
       free(usb->interfaces);
-    if (usb->interface_pool != NULL)
-      free(usb->interface_pool);
     free(usb);
     usb = NULL;
   }
@@ -556,6 +592,8 @@ static int LIBUSB_CALL usb_exit_on_unplug(libusb_context *context,
       tcp_close(g_options.tcp_socket);
     if (g_options.tcp6_socket!= NULL)
       tcp_close(g_options.tcp6_socket);
+    if (g_options.unix_socket != NULL)
+      tcp_close(g_options.unix_socket);
 
     exit(0);
   }
@@ -583,6 +621,52 @@ static void *usb_pump_events(void *user_data)
   return NULL;
 }
 
+static void *usb_pump_transfer_events(void *user_data)
+{
+  struct usb_sock_t *usb = user_data;
+
+  NOTE("USB transfer event thread starting");
+
+  while (!usb->stop_events) {
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = USB_EVENT_TIMEOUT;
+    libusb_handle_events_timeout_completed(usb->context, &tv,
+					   &usb->stop_events);
+  }
+
+  NOTE("USB transfer event thread terminating");
+
+  return NULL;
+}
+
+int usb_start_event_thread(struct usb_sock_t *usb)
+{
+  usb->stop_events = 0;
+  int status = pthread_create(&usb->event_thread, NULL,
+			      &usb_pump_transfer_events, usb);
+  if (status) {
+    ERR("Failed to start USB transfer event thread, error %d", status);
+    return -1;
+  }
+  usb->event_thread_running = 1;
+  return 0;
+}
+
+void usb_stop_event_thread(struct usb_sock_t *usb)
+{
+  if (!usb->event_thread_running)
+    return;
+
+  usb->stop_events = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  /* Wake the thread up instead of waiting for its timeout */
+  libusb_interrupt_event_handler(usb->context);
+#endif
+  pthread_join(usb->event_thread, NULL);
+  usb->event_thread_running = 0;
+}
+
 void usb_register_callback(struct usb_sock_t *usb)
 {
   IGNORE(usb);
@@ -611,132 +695,448 @@ void usb_register_callback(struct usb_sock_t *usb)
     ERR("Failed to register unplug callback");
 }
 
-struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
+/* Returns non-zero if a request of |traffic_class| may take one of |avail|
+   free interfaces. */
+static int usb_class_may_take(struct usb_sock_t *usb,
+			      enum http_class traffic_class, uint32_t avail)
 {
-  int i;
+  if (traffic_class == HTTP_CLASS_INTERACTIVE)
+    return avail > 0;
+  return avail > __atomic_load_n(&usb->num_reserved, __ATOMIC_SEQ_CST);
+}
 
-  if (usb->num_avail <= 0) {
-    NOTE("All USB interfaces busy, waiting ...");
-    for (i = 0; i < 30 && usb->num_avail <= 0; i ++) {
-      if (g_options.terminate)
-	return NULL;
-      usleep(100000);
-    }
-    if (usb->num_avail <= 0) {
-      ERR("Timed out waiting for a free USB interface");
-      return NULL;
+static int64_t usb_elapsed_us(const struct timespec *from,
+			      const struct timespec *to);
+static void usb_time_after(struct timespec *t, const struct timespec *from,
+			   uint32_t ms);
+
+/* Accounts for a request of |traffic_class| which waited for an interface
+   since |queued|. */
+static void usb_class_note_wait(struct usb_sock_t *usb,
+				enum http_class traffic_class,
+				const struct timespec *queued)
+{
+  struct usb_class_stats *stats = usb->class_stats + traffic_class;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsed = usb_elapsed_us(queued, &now);
+  uint64_t waited = elapsed > 0 ? (uint64_t)elapsed : 0;
+
+  uint32_t acquired = __atomic_add_fetch(&stats->acquired, 1,
+					 __ATOMIC_RELAXED);
+  uint64_t total = __atomic_add_fetch(&stats->wait_total, waited,
+				      __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&stats->wait_max, __ATOMIC_RELAXED);
+  while (waited > max &&
+	 !__atomic_compare_exchange_n(&stats->wait_max, &max, waited, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  if (waited >= 1000)
+    NOTE("USB: %s request waited %llu ms for an interface, "
+	 "%llu ms on average over %u, at most %llu ms",
+	 http_class_name(traffic_class), (unsigned long long)(waited / 1000),
+	 (unsigned long long)(total / acquired / 1000), acquired,
+	 (unsigned long long)((waited > max ? waited : max) / 1000));
+}
+
+/* Takes a free interface a request of |traffic_class| may take out of
+   |free_mask|. Returns its index, or -1 if there is none. */
+static int usb_pool_take(struct usb_sock_t *usb, enum http_class traffic_class)
+{
+  uint64_t mask = __atomic_load_n(&usb->free_mask, __ATOMIC_SEQ_CST);
+  for (;;) {
+    uint32_t avail = (uint32_t)__builtin_popcountll(mask);
+    if (!usb_class_may_take(usb, traffic_class, avail))
+      return -1;
+    int index = __builtin_ctzll(mask);
+    if (__atomic_compare_exchange_n(&usb->free_mask, &mask,
+				    mask & ~(1ULL << index), 1,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return index;
+  }
+}
+
+/* Returns non-zero if threads wait in line for an interface. */
+static int usb_pool_waiting(struct usb_sock_t *usb)
+{
+  for (int i = 0; i < HTTP_CLASS_COUNT; i++)
+    if (__atomic_load_n(&usb->class_stats[i].waiting, __ATOMIC_SEQ_CST))
+      return 1;
+  return 0;
+}
+
+/* Hands free interfaces to the waiters which may take them, oldest first.
+   Must be called with |pool_manage_lock| held. */
+static void usb_pool_dispatch(struct usb_sock_t *usb)
+{
+  struct usb_waiter **link = &usb->waiters_head;
+  struct usb_waiter *prev = NULL;
+
+  while (*link != NULL) {
+    struct usb_waiter *waiter = *link;
+    int index = usb_pool_take(usb, waiter->traffic_class);
+    if (index < 0) {
+      /* Interactive requests may take any interface, so none is free. Bulk
+	 ones leave the reserved ones to the interactive ones behind them. */
+      if (waiter->traffic_class == HTTP_CLASS_INTERACTIVE)
+	return;
+      prev = waiter;
+      link = &waiter->next;
+      continue;
     }
+
+    *link = waiter->next;
+    if (usb->waiters_tail == waiter)
+      usb->waiters_tail = prev;
+    waiter->interface_index = index;
+    pthread_cond_signal(&waiter->cond);
   }
+}
+
+static void usb_conn_assign(struct usb_sock_t *usb, struct usb_conn_t *conn,
+			    int index, enum http_class traffic_class)
+{
+  conn->parent = usb;
+  conn->interface_index = (uint32_t)index;
+  conn->interface = usb->interfaces + index;
+  conn->traffic_class = traffic_class;
+}
+
+/* Puts the interface |index| back into the pool. Without waiters this only
+   sets its bit; otherwise the waiters are served. The bit is set before the
+   waiters are looked at, while threads get in line before they look at the
+   bits once more, so that one of the two always sees the other. */
+static void usb_interface_return(struct usb_sock_t *usb, uint32_t index)
+{
+  __atomic_fetch_or(&usb->free_mask, 1ULL << index, __ATOMIC_SEQ_CST);
+  if (!usb_pool_waiting(usb))
+    return;
+
+  pthread_mutex_lock(&usb->pool_manage_lock);
+  usb_pool_dispatch(usb);
+  pthread_mutex_unlock(&usb->pool_manage_lock);
+}
+
+/* Takes the retired interface |index|, which is not free, out of the pool
+   for good. The reservation shrinks with the pool, so that bulk requests
+   are not left waiting for interfaces which will never come back. */
+static void usb_pool_retire(struct usb_sock_t *usb, uint32_t index)
+{
+  if (index >= USB_MAX_INTERFACES)
+    return;
+
+  pthread_mutex_lock(&usb->pool_manage_lock);
+  usb->num_pooled--;
+  usb_pool_reserve(usb);
+  usb_pool_dispatch(usb);
+  pthread_mutex_unlock(&usb->pool_manage_lock);
+}
+
+struct usb_conn_t *usb_conn_try_acquire(struct usb_sock_t *usb,
+					enum http_class traffic_class,
+					const struct timespec *queued)
+{
+  /* Waiters of any class may be owed an interface whose bit is already
+     set, see usb_interface_return() */
+  if (usb_pool_waiting(usb))
+    return NULL;
+
+  int index = usb_pool_take(usb, traffic_class);
+  if (index < 0)
+    return NULL;
 
   struct usb_conn_t *conn = calloc(1, sizeof(*conn));
   if (conn == NULL) {
     ERR("Failed to alloc space for usb connection");
+    usb_interface_return(usb, (uint32_t)index);
     return NULL;
   }
+  usb_conn_assign(usb, conn, index, traffic_class);
+  usb_class_note_wait(usb, traffic_class, queued);
+  return conn;
+}
 
-  sem_wait(&usb->pool_manage_lock);
-  {
-    conn->parent = usb;
-
-    uint32_t slot = usb->num_taken;
+/* Waits in line for an interface a request of |traffic_class| may take, see
+   usb_conn_acquire(). Returns its index, or -1 if none could be had. */
+static int usb_pool_wait(struct usb_sock_t *usb, enum http_class traffic_class)
+{
+  struct usb_class_stats *stats = usb->class_stats + traffic_class;
+
+  /* Uncontended, no lock is taken. An interface returned while others are
+     in line is theirs, even if its bit is set before they are served. */
+  if (!usb_pool_waiting(usb)) {
+    int index = usb_pool_take(usb, traffic_class);
+    if (index >= 0)
+      return index;
+  }
 
-    conn->interface_index = usb->interface_pool[slot];
-    conn->interface = usb->interfaces + conn->interface_index;
-    struct usb_interface *uf = conn->interface;
+  /* Get in line */
+  pthread_mutex_lock(&usb->pool_manage_lock);
+  struct usb_waiter waiter;
+  pthread_cond_init(&waiter.cond, NULL);
+  waiter.traffic_class = traffic_class;
+  waiter.interface_index = -1;
+  waiter.next = NULL;
+  if (usb->waiters_tail != NULL)
+    usb->waiters_tail->next = &waiter;
+  else
+    usb->waiters_head = &waiter;
+  usb->waiters_tail = &waiter;
+  __atomic_add_fetch(&stats->waiting, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&stats->queued, 1, __ATOMIC_RELAXED);
+
+  /* An interface may have been freed since we looked */
+  usb_pool_dispatch(usb);
+  if (waiter.interface_index < 0)
+    NOTE("All USB interfaces for %s requests busy, waiting ...",
+	 http_class_name(traffic_class));
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += g_options.acquire_timeout;
+
+  int recover_in = -1;
+  while (waiter.interface_index < 0 && !g_options.terminate) {
+    /* Wake up regularly as the termination flag is set from a signal
+       handler which cannot signal the condition, and when a quarantined
+       interface is due to be reset again. Without it nothing might ever
+       be released to recover it. */
+    struct timespec now, wakeup;
+    clock_gettime(CLOCK_REALTIME, &now);
+    wakeup = now;
+    wakeup.tv_sec += 1;
+    if (recover_in >= 0 && recover_in < 1000)
+      usb_time_after(&wakeup, &now, (uint32_t)recover_in);
+    if (g_options.acquire_timeout) {
+      if (now.tv_sec > deadline.tv_sec ||
+	  (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+	break;
+      if (wakeup.tv_sec > deadline.tv_sec ||
+	  (wakeup.tv_sec == deadline.tv_sec &&
+	   wakeup.tv_nsec > deadline.tv_nsec))
+	wakeup = deadline;
+    }
+    pthread_cond_timedwait(&waiter.cond, &usb->pool_manage_lock, &wakeup);
+    if (waiter.interface_index < 0 && !g_options.terminate) {
+      /* Recovered interfaces are handed out under the lock */
+      pthread_mutex_unlock(&usb->pool_manage_lock);
+      recover_in = usb_recover_interfaces(usb);
+      pthread_mutex_lock(&usb->pool_manage_lock);
+    }
+  }
 
-    /* Sanity check: Is the interface still free */
-    if (sem_trywait(&uf->lock)) {
-      ERR("Interface #%d (%d) already in use!",
-	  conn->interface_index,
-	  uf->libusb_interface_index);
-      goto acquire_error;
+  __atomic_sub_fetch(&stats->waiting, 1, __ATOMIC_SEQ_CST);
+  if (waiter.interface_index < 0) {
+    /* Leave the line, nobody handed us anything */
+    struct usb_waiter **link = &usb->waiters_head;
+    struct usb_waiter *prev = NULL;
+    while (*link != &waiter) {
+      prev = *link;
+      link = &(*link)->next;
     }
+    *link = waiter.next;
+    if (usb->waiters_tail == &waiter)
+      usb->waiters_tail = prev;
+    if (!g_options.terminate)
+      ERR("Timed out waiting for a free USB interface");
+  }
+  pthread_mutex_unlock(&usb->pool_manage_lock);
+  pthread_cond_destroy(&waiter.cond);
+
+  return waiter.interface_index;
+}
 
-    /* Take successfully acquired interface from the pool */
-    usb->num_taken++;
-    usb->num_avail--;
+struct usb_conn_t *usb_conn_new(struct usb_sock_t *usb)
+{
+  struct usb_conn_t *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL) {
+    ERR("Failed to alloc space for usb connection");
+    return NULL;
+  }
+  conn->parent = usb;
+  return conn;
+}
+
+int usb_conn_bind(struct usb_conn_t *conn, enum http_class traffic_class)
+{
+  struct usb_sock_t *usb = conn->parent;
+  struct timespec queued;
+  clock_gettime(CLOCK_MONOTONIC, &queued);
+
+  int index = usb_pool_wait(usb, traffic_class);
+  if (index < 0)
+    return -1;
+  usb_conn_assign(usb, conn, index, traffic_class);
+  usb_class_note_wait(usb, traffic_class, &queued);
+  return 0;
+}
+
+struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb,
+				    enum http_class traffic_class)
+{
+  struct usb_conn_t *conn = usb_conn_new(usb);
+  if (conn == NULL)
+    return NULL;
+  if (usb_conn_bind(conn, traffic_class)) {
+    free(conn);
+    return NULL;
   }
-  sem_post(&usb->pool_manage_lock);
   return conn;
+}
 
- acquire_error:
+void usb_conn_unbind(struct usb_conn_t *conn)
+{
+  struct usb_sock_t *usb = conn->parent;
+  struct usb_interface *uf = conn->interface;
+  uint32_t index = conn->interface_index;
+  int staled = conn->is_staled;
+
+  conn->interface = NULL;
+  conn->is_staled = 0;
+
+  sem_wait(&usb->num_staled_lock);
+  if (staled) {
+    /* Keep the interface out of service until it has been reset, which is
+       tried right away */
+    uf->quarantined = 1;
+    uf->stale_count++;
+    clock_gettime(CLOCK_MONOTONIC, &uf->next_retry);
+    uf->retry_delay = USB_RECOVER_MIN_DELAY;
+    uf->reset_failed = 0;
+    usb->num_staled++;
+  } else {
+    uf->stale_count = 0;
+  }
+  sem_post(&usb->num_staled_lock);
+
+  if (staled) {
+    NOTE("Interface #%u: Transfers failed, quarantining it", index);
+    return;
+  }
 
-  sem_post(&usb->pool_manage_lock);
+  usb_interface_return(usb, index);
+}
+
+void usb_conn_free(struct usb_conn_t *conn)
+{
+  usb_conn_read_queue_free(conn);
+  usb_conn_write_queue_free(conn);
   free(conn);
-  return NULL;
 }
 
 void usb_conn_release(struct usb_conn_t *conn)
 {
-  struct usb_sock_t *usb = conn->parent;
-  sem_wait(&usb->pool_manage_lock);
-  {
-    /* Return usb interface to pool */
-    usb->num_taken--;
-    usb->num_avail++;
-    uint32_t slot = usb->num_taken;
-    usb->interface_pool[slot] = conn->interface_index;
-
-    /* Release our interface lock */
-    sem_post(&conn->interface->lock);
-    free(conn);
+  usb_conn_unbind(conn);
+  usb_conn_free(conn);
+}
+
+/* Clears halts on both endpoints of |uf| and selects its alt setting again,
+   which resets the data toggles on both sides. */
+static int usb_interface_reset(struct usb_sock_t *usb, struct usb_interface *uf)
+{
+  int status = libusb_set_interface_alt_setting(usb->printer,
+						uf->libusb_interface_index,
+						uf->interface_alt);
+  if (status == 0)
+    status = libusb_clear_halt(usb->printer, uf->endpoint_in);
+  if (status == 0)
+    status = libusb_clear_halt(usb->printer, uf->endpoint_out);
+  return status;
+}
+
+/* Sets |t| to |ms| milliseconds after |from|. */
+static void usb_time_after(struct timespec *t, const struct timespec *from,
+			   uint32_t ms)
+{
+  t->tv_sec = from->tv_sec + ms / 1000;
+  t->tv_nsec = from->tv_nsec + (long)(ms % 1000) * 1000000;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
   }
-  sem_post(&usb->pool_manage_lock);
 }
 
-int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
+int usb_recover_interfaces(struct usb_sock_t *usb)
 {
-  int size_sent = 0;
-  const int timeout = 1000; /* 1 sec */
-  int num_timeouts = 0;
-  size_t sent = 0;
-  size_t pending = pkt->filled_size;
-  while (pending > 0 && !g_options.terminate) {
-    int to_send = (int)pending;
+  int next = -1;
 
-    NOTE("P %p: USB: want to send %d bytes", pkt, to_send);
-    int status = libusb_bulk_transfer(conn->parent->printer,
-				      conn->interface->endpoint_out,
-				      pkt->buffer + sent, to_send,
-				      &size_sent, timeout);
-    if (status == LIBUSB_ERROR_NO_DEVICE) {
-      ERR("P %p: Printer has been disconnected",
-	  pkt);
-      return -1;
+  for (uint32_t i = 0; i < usb->num_interfaces; i++) {
+    struct usb_interface *uf = usb->interfaces + i;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    sem_wait(&usb->num_staled_lock);
+    int recover = uf->quarantined && !uf->recovering && !uf->retired;
+    if (recover) {
+      int64_t due = usb_elapsed_us(&now, &uf->next_retry);
+      if (due > 0) {
+	/* Not yet, tell the caller when */
+	int ms = (int)((due + 999) / 1000);
+	if (next < 0 || ms < next)
+	  next = ms;
+	recover = 0;
+      } else {
+	uf->recovering = 1;
+      }
     }
-    if (status == LIBUSB_ERROR_TIMEOUT) {
-      NOTE("P %p: USB: send timed out, retrying", pkt);
+    sem_post(&usb->num_staled_lock);
+    if (!recover)
+      continue;
 
-      if (num_timeouts++ > PRINTER_CRASH_TIMEOUT_RECEIVE) {
-	ERR("P %p: Usb send fully timed out",
-	    pkt);
-	return -1;
-      }
+    int status = usb_interface_reset(usb, uf);
 
-      /* Sleep for tenth of a second */
-      struct timespec sleep_dur;
-      sleep_dur.tv_sec = 0;
-      sleep_dur.tv_nsec = 100000000;
-      nanosleep(&sleep_dur, NULL);
-      if (size_sent == 0)
-	continue;
-    } else if (status < 0) {
-      ERR("P %p: USB: send failed with status %s",
-	  pkt, libusb_error_name(status));
-      return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sem_wait(&usb->num_staled_lock);
+    uint32_t delay = uf->retry_delay;
+    uf->recovering = 0;
+    if (status == 0) {
+      uf->quarantined = 0;
+      usb->num_staled--;
+    } else {
+      if (!uf->reset_failed) {
+	uf->reset_failed = 1;
+	uf->failing_since = now;
+      }
+      uf->stale_count++;
+      if (uf->stale_count >= CONN_STALE_THRESHHOLD &&
+	  usb_elapsed_us(&uf->failing_since, &now) >=
+	  (int64_t)USB_RECOVER_GIVE_UP * 1000000) {
+	uf->retired = 1;
+      } else {
+	usb_time_after(&uf->next_retry, &now, delay);
+	if (next < 0 || (int)delay < next)
+	  next = (int)delay;
+	uf->retry_delay *= 2;
+	if (uf->retry_delay > USB_RECOVER_MAX_DELAY)
+	  uf->retry_delay = USB_RECOVER_MAX_DELAY;
+      }
     }
-    if (size_sent < 0) {
-      ERR("P %p: Unexpected negative size_sent",
-	  pkt);
-      return -1;
+    int retired = uf->retired;
+    int all_retired = 1;
+    for (uint32_t j = 0; j < usb->num_interfaces; j++)
+      if (!usb->interfaces[j].retired)
+	all_retired = 0;
+    sem_post(&usb->num_staled_lock);
+
+    if (status == 0) {
+      NOTE("Interface #%u: Recovered, returning it to the pool", i);
+      usb_interface_return(usb, i);
+    } else if (retired) {
+      ERR("Interface #%u: Reset failed with %s, retiring it", i,
+	  libusb_error_name(status));
+      usb_pool_retire(usb, i);
+      if (all_retired) {
+	ERR("No usable USB interface left");
+	g_options.terminate = 1;
+      }
+    } else {
+      NOTE("Interface #%u: Reset failed with %s, retrying in %u ms", i,
+	   libusb_error_name(status), delay);
     }
-
-    pending -= (size_t) size_sent;
-    sent += (size_t) size_sent;
-    NOTE("P %p: USB: sent %d bytes", pkt, size_sent);
   }
-  NOTE("P %p: USB: sent %d bytes in total", pkt, sent);
-  return 0;
+
+  return next;
 }
 
 struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
@@ -754,3 +1154,517 @@ struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
 
   return transfer;
 }
+
+/* Prepares |pkt| to hold a transfer buffer of USB_BUFFER_SIZE bytes. Where
+   libusb and the kernel support it the memory is mapped from usbfs, which
+   saves the kernel from copying the data through a buffer of its own, and
+   |dev_mem| is set. Returns -1 if no memory could be had. */
+static int usb_buffer_alloc(struct usb_conn_t *conn, struct http_packet_t *pkt,
+			    int *dev_mem)
+{
+  pkt->filled_size = 0;
+  pkt->buffer_capacity = USB_BUFFER_SIZE;
+  *dev_mem = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  pkt->buffer = libusb_dev_mem_alloc(conn->parent->printer, USB_BUFFER_SIZE);
+  if (pkt->buffer != NULL) {
+    *dev_mem = 1;
+    return 0;
+  }
+#else
+  IGNORE(conn);
+#endif
+
+  pkt->buffer = malloc(USB_BUFFER_SIZE);
+  if (pkt->buffer == NULL) {
+    ERR("Failed to alloc space for a USB transfer buffer");
+    return -1;
+  }
+  return 0;
+}
+
+static void usb_buffer_free(struct usb_conn_t *conn, struct http_packet_t *pkt,
+			    int dev_mem)
+{
+  if (pkt->buffer == NULL)
+    return;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (dev_mem)
+    libusb_dev_mem_free(conn->parent->printer, pkt->buffer,
+			pkt->buffer_capacity);
+  else
+    free(pkt->buffer);
+#else
+  IGNORE(conn);
+  IGNORE(dev_mem);
+  free(pkt->buffer);
+#endif
+  pkt->buffer = NULL;
+}
+
+static void usb_buffered_add(struct usb_sock_t *usb, size_t bytes)
+{
+  sem_wait(&usb->buffered_lock);
+  usb->buffered += bytes;
+  if (usb->buffered > usb->buffered_peak)
+    usb->buffered_peak = usb->buffered;
+  sem_post(&usb->buffered_lock);
+}
+
+static void usb_buffered_sub(struct usb_sock_t *usb, size_t bytes)
+{
+  sem_wait(&usb->buffered_lock);
+  usb->buffered -= bytes;
+  sem_post(&usb->buffered_lock);
+}
+
+/* Returns non-zero if the buffers of all connections together hold as much
+   as they may. Connections are then only allowed to go on with transfers
+   they do not have any in flight, so that each can always make progress
+   and the ones holding buffers get them back. */
+static int usb_buffered_full(struct usb_sock_t *usb)
+{
+  sem_wait(&usb->buffered_lock);
+  int full = usb->buffered + USB_BUFFER_SIZE > g_options.max_total_buffer;
+  sem_post(&usb->buffered_lock);
+  return full;
+}
+
+int usb_conn_read_queue_init(struct usb_conn_t *conn, uint32_t depth,
+			     usb_read_callback callback, void *user_data,
+			     pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+  conn->read_allocations = 0;
+  if (conn->reads != NULL && conn->read_depth != depth)
+    usb_conn_read_queue_free(conn);
+  if (conn->reads != NULL)
+    goto ready;
+
+  conn->reads = calloc(depth, sizeof(*conn->reads));
+  if (conn->reads == NULL) {
+    ERR("Failed to alloc space for %u reads", depth);
+    return -1;
+  }
+
+  conn->read_depth = depth;
+  for (uint32_t i = 0; i < depth; i++) {
+    struct usb_read *read = conn->reads + i;
+    read->conn = conn;
+    if (usb_buffer_alloc(conn, &read->pkt, &read->dev_mem))
+      goto error;
+    read->transfer = libusb_alloc_transfer(0);
+    if (read->transfer == NULL) {
+      ERR("Failed to alloc space for a USB transfer");
+      goto error;
+    }
+    conn->read_allocations += 2;
+  }
+
+ ready:
+  /* Reads the last lease left undelivered are dropped with it. */
+  for (uint32_t i = 0; i < depth; i++)
+    conn->reads[i].inflight = conn->reads[i].completed = 0;
+  if (conn->buffered_in)
+    usb_buffered_sub(conn->parent, conn->buffered_in);
+  conn->read_head = 0;
+  conn->read_tail = 0;
+  conn->reads_inflight = 0;
+  conn->buffered_in = 0;
+  conn->buffered_in_peak = 0;
+  conn->read_callback = callback;
+  conn->read_user_data = user_data;
+  conn->read_lock = lock;
+  conn->read_cond = cond;
+  return 0;
+
+ error:
+  usb_conn_read_queue_free(conn);
+  return -1;
+}
+
+static void usb_read_transfer_callback(struct libusb_transfer *transfer)
+{
+  struct usb_read *read = transfer->user_data;
+  struct usb_conn_t *conn = read->conn;
+
+  /* Runs on the libusb event thread, which must not wait for any client.
+     The owner of the queue picks the data up. */
+  pthread_mutex_lock(conn->read_lock);
+  read->status = transfer->status;
+  read->pkt.filled_size = (size_t)transfer->actual_length;
+  read->completed = 1;
+  conn->buffered_in += read->pkt.filled_size;
+  if (conn->buffered_in > conn->buffered_in_peak)
+    conn->buffered_in_peak = conn->buffered_in;
+  usb_buffered_add(conn->parent, read->pkt.filled_size);
+  pthread_cond_broadcast(conn->read_cond);
+  pthread_mutex_unlock(conn->read_lock);
+}
+
+int usb_conn_read_queue_ready(const struct usb_conn_t *conn)
+{
+  return conn->read_depth > 0 && conn->reads[conn->read_head].completed;
+}
+
+int usb_conn_read_queue_can_fill(const struct usb_conn_t *conn)
+{
+  if (conn->read_depth == 0 || conn->reads[conn->read_tail].inflight)
+    return 0;
+  if (conn->reads_inflight == 0)
+    return 1;
+  return (conn->reads_inflight + 1) * USB_BUFFER_SIZE <= g_options.max_buffer &&
+    !usb_buffered_full(conn->parent);
+}
+
+uint32_t usb_conn_read_queue_deliver(struct usb_conn_t *conn)
+{
+  uint32_t delivered = 0;
+
+  /* Hand over finished reads in the order they were submitted. Bulk
+     transfers on one endpoint complete in order anyway, this only makes sure
+     of it. */
+  while (usb_conn_read_queue_ready(conn)) {
+    struct usb_read *next = conn->reads + conn->read_head;
+
+    next->completed = 0;
+    conn->read_head = (conn->read_head + 1) % conn->read_depth;
+
+    pthread_mutex_unlock(conn->read_lock);
+    conn->read_callback(conn, &next->pkt, next->status, conn->read_user_data);
+    pthread_mutex_lock(conn->read_lock);
+
+    /* Only make the slot available again once we are done with its buffer,
+       as the owner of the queue may resubmit or free it from then on. */
+    conn->buffered_in -= next->pkt.filled_size;
+    usb_buffered_sub(conn->parent, next->pkt.filled_size);
+    next->inflight = 0;
+    conn->reads_inflight--;
+    delivered++;
+    pthread_cond_broadcast(conn->read_cond);
+  }
+
+  return delivered;
+}
+
+int usb_conn_read_queue_fill(struct usb_conn_t *conn, uint32_t timeout)
+{
+  int submitted = 0;
+
+  while (usb_conn_read_queue_can_fill(conn)) {
+    struct usb_read *read = conn->reads + conn->read_tail;
+
+    read->pkt.filled_size = 0;
+    libusb_fill_bulk_transfer(read->transfer, conn->parent->printer,
+			      conn->interface->endpoint_in, read->pkt.buffer,
+			      (int)read->pkt.buffer_capacity,
+			      usb_read_transfer_callback, read, timeout);
+
+    read->completed = 0;
+    read->inflight = 1;
+    if (libusb_submit_transfer(read->transfer)) {
+      read->inflight = 0;
+      return -1;
+    }
+
+    conn->read_tail = (conn->read_tail + 1) % conn->read_depth;
+    conn->reads_inflight++;
+    submitted++;
+  }
+
+  return submitted;
+}
+
+int usb_conn_read_queue_cancel(struct usb_conn_t *conn)
+{
+  int result = 0;
+
+  for (uint32_t i = 0; i < conn->read_depth; i++) {
+    struct usb_read *read = conn->reads + i;
+    if (!read->inflight || read->completed)
+      continue;
+    int status = libusb_cancel_transfer(read->transfer);
+    if (status && status != LIBUSB_ERROR_NOT_FOUND)
+      result = -1;
+  }
+
+  return result;
+}
+
+void usb_conn_read_queue_free(struct usb_conn_t *conn)
+{
+  if (conn->reads == NULL)
+    return;
+  for (uint32_t i = 0; i < conn->read_depth; i++) {
+    usb_buffer_free(conn, &conn->reads[i].pkt, conn->reads[i].dev_mem);
+    if (conn->reads[i].transfer != NULL)
+      libusb_free_transfer(conn->reads[i].transfer);
+  }
+  free(conn->reads);
+  conn->reads = NULL;
+  conn->read_depth = 0;
+}
+
+int usb_conn_write_queue_init(struct usb_conn_t *conn, uint32_t depth)
+{
+  if (conn->writes != NULL && conn->write_depth != depth)
+    usb_conn_write_queue_free(conn);
+  int allocate = conn->writes == NULL;
+  if (allocate) {
+    conn->writes = calloc(depth, sizeof(*conn->writes));
+    if (conn->writes == NULL) {
+      ERR("Failed to alloc space for %u writes", depth);
+      return -1;
+    }
+    conn->write_depth = depth;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    pthread_cond_init(&conn->write_cond, NULL);
+  }
+
+  conn->write_tail = 0;
+  conn->writes_inflight = 0;
+  conn->write_failed = 0;
+  conn->writes_submitted = 0;
+  conn->bytes_written = 0;
+  conn->bytes_inflight = 0;
+  conn->bytes_inflight_peak = 0;
+  conn->write_rate = 0;
+  conn->write_stalled = 0;
+  conn->write_stalls = 0;
+  conn->write_stall_time = 0;
+  if (!allocate)
+    return 0;
+
+  for (uint32_t i = 0; i < depth; i++) {
+    struct usb_write *write = conn->writes + i;
+    write->conn = conn;
+    write->transfer = libusb_alloc_transfer(0);
+    if (write->transfer == NULL) {
+      ERR("Failed to alloc space for a USB transfer");
+      usb_conn_write_queue_free(conn);
+      return -1;
+    }
+    if (usb_buffer_alloc(conn, &write->pkt, &write->dev_mem)) {
+      usb_conn_write_queue_free(conn);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int64_t usb_elapsed_us(const struct timespec *from,
+			      const struct timespec *to)
+{
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+    (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void usb_write_transfer_callback(struct libusb_transfer *transfer)
+{
+  struct usb_write *write = transfer->user_data;
+  struct usb_conn_t *conn = write->conn;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&conn->write_lock);
+  int64_t elapsed = usb_elapsed_us(&conn->write_progress, &now);
+  if (conn->write_stalled) {
+    conn->write_stall_time += (uint64_t)elapsed;
+    conn->write_stalled = 0;
+  }
+  if (elapsed > 0 && transfer->actual_length > 0) {
+    double rate = (double)transfer->actual_length * 1e6 / (double)elapsed;
+    conn->write_rate = conn->write_rate > 0 ?
+      (3 * conn->write_rate + rate) / 4 : rate;
+  }
+  conn->write_progress = now;
+  conn->bytes_written += (size_t)transfer->actual_length;
+  conn->bytes_inflight -= (size_t)transfer->length;
+  usb_buffered_sub(conn->parent, (size_t)transfer->length);
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+    conn->write_failed = 1;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    ERR("Interface #%u: Printer has been disconnected",
+	conn->interface_index);
+    conn->write_failed = 1;
+    break;
+  default:
+    ERR("Interface #%u: USB: send failed with status %d",
+	conn->interface_index, transfer->status);
+    conn->write_failed = 1;
+    conn->is_staled = 1;
+  }
+  write->inflight = 0;
+  conn->writes_inflight--;
+  pthread_cond_broadcast(&conn->write_cond);
+  pthread_mutex_unlock(&conn->write_lock);
+}
+
+/* Time in milliseconds the writes in flight should take at the rate the
+   printer took data at so far, with some slack. */
+static long usb_write_timeout(const struct usb_conn_t *conn)
+{
+  if (conn->write_rate <= 0)
+    return USB_WRITE_MAX_TIMEOUT;
+  long timeout = (long)(2e3 * (double)conn->bytes_inflight / conn->write_rate);
+  if (timeout < USB_WRITE_MIN_TIMEOUT)
+    return USB_WRITE_MIN_TIMEOUT;
+  if (timeout > USB_WRITE_MAX_TIMEOUT)
+    return USB_WRITE_MAX_TIMEOUT;
+  return timeout;
+}
+
+/* Waits for the next write to complete, with |write_lock| held. The waiting
+   ends with the completion, there is no polling. The writes have no timeout
+   of their own, as a write which timed out could not be retried without
+   reordering the data behind it. The adaptive timeout here only tells when
+   the printer is stalling, for the statistics, and the caller gives up once
+   the printer has not taken anything for PRINTER_CRASH_TIMEOUT_RECEIVE
+   seconds. */
+static void usb_write_wait(struct usb_conn_t *conn)
+{
+  size_t written = conn->bytes_written;
+  long timeout = usb_write_timeout(conn);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_cond_timedwait(&conn->write_cond, &conn->write_lock, &deadline);
+  if (conn->bytes_written != written || conn->writes_inflight == 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t idle = usb_elapsed_us(&conn->write_progress, &now);
+  if (idle < timeout * 1000)
+    return;
+  if (!conn->write_stalled) {
+    NOTE("Interface #%u: Printer takes no data for %ld ms, stalling",
+	 conn->interface_index, timeout);
+    conn->write_stalled = 1;
+    conn->write_stalls++;
+  }
+  if (idle > (int64_t)PRINTER_CRASH_TIMEOUT_RECEIVE * 1000000) {
+    ERR("Interface #%u: Usb send fully timed out", conn->interface_index);
+    conn->write_stall_time += (uint64_t)idle;
+    conn->write_stalled = 0;
+    conn->write_failed = 1;
+  }
+}
+
+/* Returns non-zero if another full buffer would exceed the byte budget of
+   the connection or the global one, while writes are in flight whose
+   completion brings the usage down again. */
+static int usb_write_over_budget(struct usb_conn_t *conn)
+{
+  if (conn->writes_inflight == 0)
+    return 0;
+  return conn->bytes_inflight + USB_BUFFER_SIZE > g_options.max_buffer ||
+    usb_buffered_full(conn->parent);
+}
+
+struct http_packet_t *usb_conn_write_queue_get(struct usb_conn_t *conn)
+{
+  struct http_packet_t *pkt = NULL;
+
+  pthread_mutex_lock(&conn->write_lock);
+  struct usb_write *write = conn->writes + conn->write_tail;
+  while ((write->inflight || usb_write_over_budget(conn)) &&
+	 !conn->write_failed && !g_options.terminate)
+    usb_write_wait(conn);
+  if (!conn->write_failed && !g_options.terminate) {
+    pkt = &write->pkt;
+    pkt->filled_size = 0;
+  }
+  pthread_mutex_unlock(&conn->write_lock);
+
+  return pkt;
+}
+
+int usb_conn_write_queue_submit(struct usb_conn_t *conn)
+{
+  pthread_mutex_lock(&conn->write_lock);
+  struct usb_write *write = conn->writes + conn->write_tail;
+  if (conn->write_failed || g_options.terminate || write->inflight)
+    goto error;
+
+  libusb_fill_bulk_transfer(write->transfer, conn->parent->printer,
+			    conn->interface->endpoint_out, write->pkt.buffer,
+			    (int)write->pkt.filled_size,
+			    usb_write_transfer_callback, write, 0);
+  if (conn->writes_inflight == 0)
+    clock_gettime(CLOCK_MONOTONIC, &conn->write_progress);
+  write->inflight = 1;
+  if (libusb_submit_transfer(write->transfer)) {
+    ERR("Interface #%u: Failed to submit USB write", conn->interface_index);
+    write->inflight = 0;
+    conn->write_failed = 1;
+    goto error;
+  }
+  conn->writes_inflight++;
+  conn->writes_submitted++;
+  conn->bytes_inflight += write->pkt.filled_size;
+  if (conn->bytes_inflight > conn->bytes_inflight_peak)
+    conn->bytes_inflight_peak = conn->bytes_inflight;
+  usb_buffered_add(conn->parent, write->pkt.filled_size);
+  conn->write_tail = (conn->write_tail + 1) % conn->write_depth;
+  pthread_mutex_unlock(&conn->write_lock);
+  return 0;
+
+ error:
+  pthread_mutex_unlock(&conn->write_lock);
+  return -1;
+}
+
+int usb_conn_write_queue_flush(struct usb_conn_t *conn)
+{
+  pthread_mutex_lock(&conn->write_lock);
+  while (conn->writes_inflight && !conn->write_failed && !g_options.terminate)
+    usb_write_wait(conn);
+  int result = conn->writes_inflight || conn->write_failed ? -1 : 0;
+  pthread_mutex_unlock(&conn->write_lock);
+  return result;
+}
+
+void usb_conn_write_queue_cancel(struct usb_conn_t *conn)
+{
+  if (conn->writes == NULL)
+    return;
+
+  pthread_mutex_lock(&conn->write_lock);
+  for (uint32_t i = 0; i < conn->write_depth; i++)
+    if (conn->writes[i].inflight)
+      libusb_cancel_transfer(conn->writes[i].transfer);
+  while (conn->writes_inflight)
+    pthread_cond_wait(&conn->write_cond, &conn->write_lock);
+  pthread_mutex_unlock(&conn->write_lock);
+}
+
+void usb_conn_write_queue_free(struct usb_conn_t *conn)
+{
+  if (conn->writes == NULL)
+    return;
+
+  usb_conn_write_queue_cancel(conn);
+
+  for (uint32_t i = 0; i < conn->write_depth; i++) {
+    usb_buffer_free(conn, &conn->writes[i].pkt, conn->writes[i].dev_mem);
+    if (conn->writes[i].transfer != NULL)
+      libusb_free_transfer(conn->writes[i].transfer);
+  }
+  free(conn->writes);
+  conn->writes = NULL;
+  conn->write_depth = 0;
+  pthread_mutex_destroy(&conn->write_lock);
+  pthread_cond_destroy(&conn->write_cond);
+}
@@ -15,20 +15,87 @@
 #pragma once
 
 #include <libusb.h>
+#include <pthread.h>
 #include <semaphore.h>
 
+#include "http.h"
+
 /* In seconds */
 #define PRINTER_CRASH_TIMEOUT_RECEIVE (60 * 60 * 6)
 #define PRINTER_CRASH_TIMEOUT_ANSWER 5
 #define CONN_STALE_THRESHHOLD 5
 
+/* In milliseconds, the delay before a quarantined interface is reset again
+   after a failed reset, doubling from the first to the longest */
+#define USB_RECOVER_MIN_DELAY 100
+#define USB_RECOVER_MAX_DELAY 3200
+/* In seconds, how long resets of an interface have to keep failing before
+   it is retired */
+#define USB_RECOVER_GIVE_UP 30
+
+/* In microseconds, the longest the transfer event thread blocks in libusb
+   before it looks at its stop flag again */
+#define USB_EVENT_TIMEOUT 100000
+
+/* In milliseconds, the bounds of the time a write may take before the
+   printer is considered to be stalling. Within them it adapts to the rate
+   the printer takes data at. */
+#define USB_WRITE_MIN_TIMEOUT 10
+#define USB_WRITE_MAX_TIMEOUT 1000
+
+/* Size of the buffers the read and write queues transfer from and to */
+#define USB_BUFFER_SIZE (1 << 15)
+
 struct usb_interface {
   uint8_t interface_number;
   uint8_t libusb_interface_index;
   int interface_alt;
   uint8_t endpoint_in;
   uint8_t endpoint_out;
-  sem_t lock;
+  /* wMaxPacketSize of |endpoint_out| */
+  uint16_t max_packet_out;
+
+  /* Health of the interface, guarded by the num_staled_lock of the
+     usb_sock_t. An interface whose transfers failed is quarantined, kept out
+     of the pool until usb_recover_interfaces() has reset it. A failed reset
+     is retried at |next_retry|, after |retry_delay| milliseconds which
+     double every time. The interface is retired for good after
+     CONN_STALE_THRESHHOLD failures in a row, once its resets have kept
+     failing for USB_RECOVER_GIVE_UP seconds since |failing_since|. */
+  int quarantined;
+  int recovering;
+  int retired;
+  uint32_t stale_count;
+  struct timespec next_retry;
+  uint32_t retry_delay;
+  int reset_failed;
+  struct timespec failing_since;
+};
+
+/* Interfaces the pool can hold, one bit of |free_mask| each */
+#define USB_MAX_INTERFACES 64
+
+/* A thread waiting for an interface. An interface freed while it waits is
+   handed to the oldest one which may take it directly, through
+   |interface_index|. */
+struct usb_waiter {
+  pthread_cond_t cond;
+  enum http_class traffic_class;
+  int interface_index;
+  struct usb_waiter *next;
+};
+
+/* How long the requests of one traffic class waited for an interface.
+   Updated with atomic operations. */
+struct usb_class_stats {
+  uint32_t acquired;
+  /* Requests which had to get in line */
+  uint32_t queued;
+  /* Threads of the class in the line of waiters */
+  uint32_t waiting;
+  /* Microseconds */
+  uint64_t wait_total;
+  uint64_t wait_max;
 };
 
 struct usb_sock_t {
@@ -40,35 +107,231 @@ struct usb_sock_t {
   uint32_t num_interfaces;
   struct usb_interface *interfaces;
 
+  /* Interfaces in quarantine */
   uint32_t num_staled;
   sem_t num_staled_lock;
 
-  sem_t pool_manage_lock;
-  uint32_t num_avail;
-  uint32_t num_taken;
+  /* Free interfaces, one bit per interface. Taken and given back with
+     atomic operations, so that |pool_manage_lock| is only needed once
+     threads have to wait in line. |num_pooled| counts the interfaces in the
+     pool, retired ones leave it for good, guarded by |pool_manage_lock|. */
+  uint64_t free_mask;
+  uint32_t num_pooled;
+  pthread_mutex_t pool_manage_lock;
+
+  /* Interfaces only interactive requests may take, so that status polls get
+     through while bulk requests occupy the others. Recomputed under
+     |pool_manage_lock| when the pool shrinks, read atomically. */
+  uint32_t num_reserved;
+
+  /* Threads waiting in usb_conn_acquire(), oldest first, guarded by
+     |pool_manage_lock|, and the queueing statistics per traffic class. */
+  struct usb_waiter *waiters_head;
+  struct usb_waiter *waiters_tail;
+  struct usb_class_stats class_stats[HTTP_CLASS_COUNT];
 
-  uint32_t *interface_pool;
+  /* Bytes held in the transfer buffers of all connections, waiting to be
+     written to the printer or sent to a client, and the most ever held.
+     Kept below g_options.max_total_buffer. */
+  sem_t buffered_lock;
+  size_t buffered;
+  size_t buffered_peak;
+
+  /* Thread delivering the completions of the transfers on |context| */
+  pthread_t event_thread;
+  int event_thread_running;
+  int stop_events;
+};
+
+struct usb_conn_t;
+
+/* Called for every completed read from the printer, in the order the reads
+   were submitted, by the thread calling usb_conn_read_queue_deliver(). |pkt|
+   holds what has been received and is only valid during the call. */
+typedef void (*usb_read_callback)(struct usb_conn_t *conn,
+				  struct http_packet_t *pkt,
+				  enum libusb_transfer_status status,
+				  void *user_data);
+
+/* One slot of the read queue. Its transfer and buffer are allocated with the
+   queue and resubmitted for every read. The buffer comes from
+   libusb_dev_mem_alloc() if possible, see |dev_mem|, so that the kernel
+   transfers straight from and to it. */
+struct usb_read {
+  struct usb_conn_t *conn;
+  struct libusb_transfer *transfer;
+  struct http_packet_t pkt;
+  int dev_mem;
+  enum libusb_transfer_status status;
+  /* Submitted and not yet handed to the read callback */
+  int inflight;
+  /* Finished, waiting to be handed to the read callback */
+  int completed;
+};
+
+/* One slot of the write queue, which owns its transfer and buffer like the
+   slots of the read queue. */
+struct usb_write {
+  struct usb_conn_t *conn;
+  struct libusb_transfer *transfer;
+  struct http_packet_t pkt;
+  int dev_mem;
+  int inflight;
 };
 
 struct usb_conn_t {
   struct usb_sock_t *parent;
   struct usb_interface *interface;
   uint32_t interface_index;
+  enum http_class traffic_class;
+  /* Set when a transfer failed in a way which leaves the interface in an
+     unknown state, so that usb_conn_release() quarantines it. */
   int is_staled;
+
+  /* Ring of up to |read_depth| reads kept in flight on the IN endpoint, so
+     that the printer can hand over more data while earlier responses are
+     still being forwarded. The libusb event thread only marks reads as
+     completed and the owner of the queue, the only other party, hands them
+     over from its own thread, so that a slow client never holds up the
+     completions of other connections. The ring is guarded by |read_lock|
+     and every completed and every delivered read is broadcast on
+     |read_cond|. */
+  uint32_t read_depth;
+  struct usb_read *reads;
+  uint32_t read_head;
+  uint32_t read_tail;
+  uint32_t reads_inflight;
+  usb_read_callback read_callback;
+  void *read_user_data;
+  pthread_mutex_t *read_lock;
+  pthread_cond_t *read_cond;
+  /* Transfers and buffers the last usb_conn_read_queue_init() allocated,
+     none if it reused those of an earlier lease, for the statistics. */
+  uint32_t read_allocations;
+  /* Bytes received from the printer and not yet handed to the client, and
+     the most ever. Reads are only submitted while the buffers in use fit
+     into g_options.max_buffer. */
+  size_t buffered_in;
+  size_t buffered_in_peak;
+
+  /* Ring of up to |write_depth| writes submitted to the OUT endpoint, so that
+     the next packet can be read from the client while the previous ones are
+     still on their way to the printer. Bulk transfers on one endpoint finish
+     in order, so the slot at |write_tail| is always the next to become free.
+     Guarded by |write_lock|, completions are broadcast on |write_cond|. */
+  uint32_t write_depth;
+  struct usb_write *writes;
+  uint32_t write_tail;
+  uint32_t writes_inflight;
+  int write_failed;
+  uint32_t writes_submitted;
+  size_t bytes_written;
+  /* Bytes on their way to the printer, and the most ever. The next slot is
+     only handed out while the buffers in use fit into
+     g_options.max_buffer. */
+  size_t bytes_inflight;
+  size_t bytes_inflight_peak;
+  /* Last time a write completed or the queue started from empty, and the
+     smoothed rate in bytes per second the printer took data at. */
+  struct timespec write_progress;
+  double write_rate;
+  /* Times the printer stopped taking data for longer than the adaptive
+     timeout, and the time in microseconds it spent not taking any. */
+  int write_stalled;
+  uint32_t write_stalls;
+  uint64_t write_stall_time;
+  pthread_mutex_t write_lock;
+  pthread_cond_t write_cond;
 };
 
 struct usb_sock_t *usb_open(void);
 void usb_close(struct usb_sock_t *);
 
+/* Starts a thread which handles the events of the device's libusb context,
+   so that the callbacks of asynchronous transfers run as soon as they
+   complete. Not needed when the caller handles the context's events itself,
+   like the event loop does. usb_close() stops the thread. */
+int usb_start_event_thread(struct usb_sock_t *);
+void usb_stop_event_thread(struct usb_sock_t *);
+
 int usb_can_callback(struct usb_sock_t *);
 void usb_register_callback(struct usb_sock_t *);
 
-struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *);
+/* Waits in line for an interface a request of |traffic_class| may take, up to
+   g_options.acquire_timeout seconds if that is not 0, and returns NULL if
+   none became free in time or the daemon is shutting down. Bulk requests
+   leave the last |num_reserved| free interfaces to interactive ones, which
+   never wait behind them. */
+struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *,
+				    enum http_class traffic_class);
+/* Like usb_conn_acquire() but returns NULL right away instead of waiting when
+   no interface may be taken or other threads are waiting already.
+   |queued| is when the caller started waiting, for the statistics. */
+struct usb_conn_t *usb_conn_try_acquire(struct usb_sock_t *,
+					enum http_class traffic_class,
+					const struct timespec *queued);
 void usb_conn_release(struct usb_conn_t *);
-
-int usb_conn_packet_send(struct usb_conn_t *, struct http_packet_t *);
+/* The steps of usb_conn_acquire() and usb_conn_release(), for a caller which
+   keeps one connection, with its read and write queues, across many leases.
+   usb_conn_new() makes a connection holding no interface. usb_conn_bind()
+   waits for an interface like usb_conn_acquire() and returns 0 once the
+   connection holds it, or -1. usb_conn_unbind() gives it back, or puts it in
+   quarantine, and must only be called with no transfer in flight.
+   usb_conn_free() frees an unbound connection and its queues. */
+struct usb_conn_t *usb_conn_new(struct usb_sock_t *);
+int usb_conn_bind(struct usb_conn_t *, enum http_class traffic_class);
+void usb_conn_unbind(struct usb_conn_t *);
+void usb_conn_free(struct usb_conn_t *);
+/* Resets the quarantined interfaces which are due and returns the ones which
+   recovered to the pool. Returns the milliseconds until the next reset is
+   due, for the caller to call again by then, or -1 if no interface is in
+   quarantine. This does synchronous USB I/O, so it must not be called from a
+   transfer callback. */
+int usb_recover_interfaces(struct usb_sock_t *);
 
 struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
                                          struct http_packet_t *pkt,
                                          libusb_transfer_cb_fn callback,
                                          void *user_data, uint32_t timeout);
+
+/* Read queue of a connection, see struct usb_conn_t. Except for
+   usb_conn_read_queue_init() and usb_conn_read_queue_free(), which must only
+   be called while no read is in flight, the caller must hold |lock|.
+   usb_conn_read_queue_init() keeps the reads of an earlier call if there are
+   as many, and only points them at the new callback.
+   usb_conn_read_queue_fill() returns the number of reads submitted or -1 if
+   submitting failed. usb_conn_read_queue_ready() tells whether a completed
+   read waits to be delivered and usb_conn_read_queue_deliver() passes all
+   such reads to the read callback, with |lock| released during the calls,
+   and returns how many it delivered. */
+int usb_conn_read_queue_init(struct usb_conn_t *conn, uint32_t depth,
+			     usb_read_callback callback, void *user_data,
+			     pthread_mutex_t *lock, pthread_cond_t *cond);
+int usb_conn_read_queue_fill(struct usb_conn_t *conn, uint32_t timeout);
+int usb_conn_read_queue_ready(const struct usb_conn_t *conn);
+/* Returns non-zero if usb_conn_read_queue_fill() would submit a read, that is
+   if a slot is free and the byte budgets allow for another read. */
+int usb_conn_read_queue_can_fill(const struct usb_conn_t *conn);
+uint32_t usb_conn_read_queue_deliver(struct usb_conn_t *conn);
+int usb_conn_read_queue_cancel(struct usb_conn_t *conn);
+void usb_conn_read_queue_free(struct usb_conn_t *conn);
+
+/* Write queue of a connection, see struct usb_conn_t. All functions are to
+   be called from one thread. usb_conn_write_queue_get() waits for the next
+   slot to be free and returns its empty packet, or NULL if the printer
+   stopped taking data or went away. The data for the printer is to be
+   received straight into it, up to its capacity, and
+   usb_conn_write_queue_submit() then submits it as it is.
+   usb_conn_write_queue_flush() waits until everything submitted reached the
+   printer. Both resume as soon as the printer takes data again after a
+   stall. Both return 0 on success and -1 if the printer stopped taking data
+   or went away. usb_conn_write_queue_cancel() cancels whatever is still in
+   flight and waits until it is back, keeping the slots for the next
+   usb_conn_write_queue_init(), which reuses them if there are as many.
+   usb_conn_write_queue_free() cancels and frees them. */
+int usb_conn_write_queue_init(struct usb_conn_t *conn, uint32_t depth);
+struct http_packet_t *usb_conn_write_queue_get(struct usb_conn_t *conn);
+int usb_conn_write_queue_submit(struct usb_conn_t *conn);
+int usb_conn_write_queue_flush(struct usb_conn_t *conn);
+void usb_conn_write_queue_cancel(struct usb_conn_t *conn);
+void usb_conn_write_queue_free(struct usb_conn_t *conn);